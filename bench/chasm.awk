@@ -0,0 +1,21 @@
+# Writes a chasm source of about n lines for make bench-chasm: blocks under
+# a label each, with jumps to labels before and after them and a DATA slot
+# for every block, so every reference goes through the symbol table.
+BEGIN {
+  blocks = int(n / 8) + 1
+  print "main:"
+  print "  PUSH DWORD " blocks
+  for (i = 0; i < blocks; i++) {
+    print "block" i ":"
+    print "  PUSH WORD " (i % 1000)
+    print "  LOAD U64 DWORD &slot" ((i * 7919) % blocks)
+    print "  ADD U64"
+    print "  STORE U64 DWORD &slot" i
+    print "  JNZ DWORD &block" ((i * 104729) % blocks)
+    print "  POP"
+  }
+  print "  HALT"
+  for (i = 0; i < blocks; i++) {
+    print "slot" i ": DATA U64 " i
+  }
+}
@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Timing harness of make bench: runs each program with cvm on each mode a
+ * number of times and reports the mean with a 95% confidence interval of
+ * the nanoseconds per instruction and the instructions a second, and the
+ * peak resident memory of the runs. Instructions are counted once for each
+ * program with cvm --profile, which counts them unfused, so every mode is
+ * measured against the same count. Times are of the whole process, loading
+ * the image included. The programs end with PSTATE, and the data stack it
+ * prints on the warm-up run of each mode has to be the one of the step
+ * interpreter, a mode that computes something else is not timed. Runs that
+ * fall back from -V to the checked interpreter are marked. The results are
+ * saved as JSON, one entry a line, and compared with the ones of an earlier
+ * run when given. */
+
+#define BENCH_MAX_MODES 8
+#define BENCH_MAX_RUNS 1000
+#define BENCH_MAX_STACK 4096
+
+struct bench_result {
+  const char *program;
+  const char *mode;
+  uint64_t instructions;
+  size_t runs;
+  double seconds;     // mean
+  double seconds_ci;  // half of the 95% confidence interval
+  double ns_per_insn; // of the mean time
+  double ns_per_insn_ci;
+  double insns_per_sec;
+  long peak_rss_kb; // largest of the runs
+  int unverified;   // cvm ran -V code with the runtime checks
+};
+
+// Two-sided 95% quantiles of Student's t by degrees of freedom
+static double bench_t95(size_t df) {
+  static const double t[] = {0,     12.706, 4.303, 3.182, 2.776, 2.571, 2.447,
+                             2.365, 2.306,  2.262, 2.228, 2.201, 2.179, 2.160,
+                             2.145, 2.131,  2.120, 2.110, 2.101, 2.093, 2.086,
+                             2.080, 2.074,  2.069, 2.064, 2.060, 2.056, 2.052,
+                             2.048, 2.045,  2.042};
+  if (df < sizeof(t) / sizeof(t[0])) {
+    return t[df];
+  }
+  return df < 60 ? 2.000 : df < 120 ? 1.980 : 1.960;
+}
+
+static double bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Runs cvm once with its output and errors written on out and err, or
+// dropped when NULL, 0 when it ran and exited with 0
+static int bench_spawn(char **argv, FILE *out, FILE *err, double *seconds,
+                       long *rss_kb) {
+  double start = bench_now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(out != NULL ? fileno(out) : null, STDOUT_FILENO);
+    dup2(err != NULL ? fileno(err) : null, STDERR_FILENO);
+    execv(argv[0], argv);
+    perror("exec cvm");
+    _exit(127);
+  }
+
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) {
+    perror("wait");
+    return -1;
+  }
+  *seconds = bench_now() - start;
+  *rss_kb = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Instructions the program runs, read from a profile of cvm
+static int bench_count(const char *cvm, const char *program,
+                       uint64_t *instructions) {
+  char report[] = "/tmp/cvmbench-XXXXXX.json";
+  int fd = mkstemps(report, 5);
+  if (fd < 0) {
+    perror("profile report");
+    return -1;
+  }
+  close(fd);
+
+  char option[64 + sizeof(report)];
+  snprintf(option, sizeof(option), "--profile=%s", report);
+  char *argv[] = {(char *)cvm, option, (char *)program, NULL};
+  double seconds = 0;
+  long rss_kb = 0;
+  int rc = bench_spawn(argv, NULL, NULL, &seconds, &rss_kb);
+
+  FILE *in = rc == 0 ? fopen(report, "r") : NULL;
+  char line[256];
+  rc = -1;
+  while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+    if (sscanf(line, " \"instructions\": %" SCNu64, instructions) == 1) {
+      rc = 0;
+      break;
+    }
+  }
+  if (in != NULL) {
+    fclose(in);
+  }
+  unlink(report);
+  if (rc != 0) {
+    fprintf(stderr, "error: cannot count the instructions of %s\n", program);
+  }
+  return rc;
+}
+
+// Command line of cvm for the mode, step runs the step interpreter
+static void bench_argv(char **argv, const char *cvm, const char *mode,
+                       const char *program) {
+  size_t argc = 0;
+  argv[argc++] = (char *)cvm;
+  if (mode[0] != '\0' && strcmp(mode, "step") != 0) {
+    argv[argc++] = (char *)mode;
+  }
+  argv[argc++] = (char *)program;
+  argv[argc] = NULL;
+}
+
+// Data stack printed by the PSTATE of a run, without its addresses
+static int bench_stack(FILE *out, char *stack, size_t size) {
+  char line[256];
+  size_t len = 0;
+  int inside = 0;
+  int found = 0;
+  stack[0] = '\0';
+  rewind(out);
+  while (fgets(line, sizeof(line), out) != NULL) {
+    if (strncmp(line, "data stack:", 11) == 0) {
+      inside = 1;
+      found = 1;
+      len = 0;
+    } else if (strncmp(line, "call stack:", 11) == 0) {
+      inside = 0;
+    } else if (inside && strstr(line, "bot:") == NULL &&
+               len + strlen(line) < size) {
+      strcpy(stack + len, line);
+      len += strlen(line);
+    }
+  }
+  return found ? 0 : -1;
+}
+
+// Runs the program once with the mode, keeping the data stack it ends with
+// and whether cvm ran it with the runtime checks
+static int bench_once(const char *cvm, const char *program, const char *mode,
+                      char *stack, int *unverified) {
+  char *argv[4];
+  bench_argv(argv, cvm, mode, program);
+
+  FILE *out = tmpfile();
+  FILE *err = tmpfile();
+  if (out == NULL || err == NULL) {
+    perror("run output");
+    if (out != NULL) {
+      fclose(out);
+    }
+    if (err != NULL) {
+      fclose(err);
+    }
+    return -1;
+  }
+
+  double seconds = 0;
+  long rss_kb = 0;
+  int rc = bench_spawn(argv, out, err, &seconds, &rss_kb);
+
+  // what cvm reports is still shown
+  char line[256];
+  *unverified = 0;
+  rewind(err);
+  while (fgets(line, sizeof(line), err) != NULL) {
+    fputs(line, stderr);
+    if (strstr(line, "code not verified") != NULL) {
+      *unverified = 1;
+    }
+  }
+
+  if (rc != 0) {
+    fprintf(stderr, "error: %s failed with '%s'\n", program, mode);
+  } else if (bench_stack(out, stack, BENCH_MAX_STACK) != 0) {
+    fprintf(stderr, "error: %s prints no state with '%s'\n", program, mode);
+    rc = -1;
+  }
+  fclose(out);
+  fclose(err);
+  return rc;
+}
+
+static int bench_run(const char *cvm, const char *program, const char *mode,
+                     const char *expected, size_t runs,
+                     struct bench_result *result) {
+  char *argv[4];
+  bench_argv(argv, cvm, mode, program);
+
+  // a warm-up run fills the page cache and checks the result
+  char stack[BENCH_MAX_STACK];
+  if (bench_once(cvm, program, mode, stack, &result->unverified) != 0) {
+    return -1;
+  }
+  if (strcmp(stack, expected) != 0) {
+    fprintf(stderr,
+            "error: %s ends with a different data stack with '%s':\n%s"
+            "instead of:\n%s",
+            program, mode, stack, expected);
+    return -1;
+  }
+
+  double seconds = 0;
+  long rss_kb = 0;
+  double sum = 0;
+  double squares = 0;
+  result->peak_rss_kb = 0;
+  for (size_t i = 0; i < runs; i++) {
+    if (bench_spawn(argv, NULL, NULL, &seconds, &rss_kb) != 0) {
+      fprintf(stderr, "error: %s failed with '%s'\n", program, mode);
+      return -1;
+    }
+    sum += seconds;
+    squares += seconds * seconds;
+    if (rss_kb > result->peak_rss_kb) {
+      result->peak_rss_kb = rss_kb;
+    }
+  }
+
+  double mean = sum / runs;
+  double variance = 0;
+  if (runs > 1) {
+    variance = (squares - sum * mean) / (runs - 1);
+  }
+  double insns = result->instructions > 0 ? result->instructions : 1;
+  result->program = program;
+  result->mode = mode;
+  result->runs = runs;
+  result->seconds = mean;
+  result->seconds_ci =
+      runs > 1 ? bench_t95(runs - 1) * sqrt(variance > 0 ? variance : 0) /
+                     sqrt(runs)
+               : 0;
+  result->ns_per_insn = mean * 1e9 / insns;
+  result->ns_per_insn_ci = result->seconds_ci * 1e9 / insns;
+  result->insns_per_sec = insns / mean;
+  return 0;
+}
+
+static void bench_json(FILE *out, const char *label,
+                       const struct bench_result *results, size_t len) {
+  fprintf(out, "{\n  \"label\": \"%s\",\n  \"results\": [", label);
+  for (size_t i = 0; i < len; i++) {
+    const struct bench_result *result = &results[i];
+    fprintf(out,
+            "%s\n    {\"program\": \"%s\", \"mode\": \"%s\", "
+            "\"instructions\": %" PRIu64 ", \"runs\": %zu, "
+            "\"seconds\": %.6f, \"seconds_ci95\": %.6f, "
+            "\"ns_per_insn\": %.4f, \"ns_per_insn_ci95\": %.4f, "
+            "\"insns_per_sec\": %.0f, \"peak_rss_kb\": %ld, "
+            "\"unverified\": %s}",
+            i > 0 ? "," : "", result->program, result->mode,
+            result->instructions, result->runs, result->seconds,
+            result->seconds_ci, result->ns_per_insn, result->ns_per_insn_ci,
+            result->insns_per_sec, result->peak_rss_kb,
+            result->unverified ? "true" : "false");
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+// ns/insn of the program and mode on an earlier JSON, or 0 without it
+static double bench_baseline(FILE *in, const char *program, const char *mode) {
+  char line[1024];
+  char name[256];
+  char flags[64];
+  double ns_per_insn = 0;
+  rewind(in);
+  while (fgets(line, sizeof(line), in) != NULL) {
+    char *entry = strstr(line, "{\"program\": \"");
+    char *ns = strstr(line, "\"ns_per_insn\": ");
+    if (entry == NULL || ns == NULL ||
+        sscanf(entry, "{\"program\": \"%255[^\"]\", \"mode\": \"%63[^\"]\"",
+               name, flags) < 1 ||
+        sscanf(ns, "\"ns_per_insn\": %lf", &ns_per_insn) != 1) {
+      continue;
+    }
+
+    // an empty mode leaves flags as it was
+    if (strstr(entry, "\"mode\": \"\"") != NULL) {
+      flags[0] = '\0';
+    }
+    if (strcmp(name, program) == 0 && strcmp(flags, mode) == 0) {
+      return ns_per_insn;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *cvm = "bin/cvm";
+  const char *json_filename = NULL;
+  const char *compare_filename = NULL;
+  const char *label = "";
+  const char *modes[BENCH_MAX_MODES];
+  size_t modes_len = 0;
+  size_t runs = 10;
+  char **programs = NULL;
+  int programs_len = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--cvm=", 6) == 0 && argv[i][6] != '\0') {
+      cvm = argv[i] + 6;
+    } else if (strncmp(argv[i], "--runs=", 7) == 0 && argv[i][7] != '\0') {
+      runs = strtoul(argv[i] + 7, NULL, 10);
+    } else if (strncmp(argv[i], "--mode=", 7) == 0 &&
+               modes_len < BENCH_MAX_MODES) {
+      modes[modes_len++] = argv[i] + 7;
+    } else if (strncmp(argv[i], "--json=", 7) == 0 && argv[i][7] != '\0') {
+      json_filename = argv[i] + 7;
+    } else if (strncmp(argv[i], "--compare=", 10) == 0 &&
+               argv[i][10] != '\0') {
+      compare_filename = argv[i] + 10;
+    } else if (strncmp(argv[i], "--label=", 8) == 0) {
+      label = argv[i] + 8;
+    } else if (argv[i][0] != '-') {
+      programs = argv + i;
+      programs_len = argc - i;
+      break;
+    } else {
+      programs = NULL;
+      break;
+    }
+  }
+
+  if (programs == NULL || runs == 0 || runs > BENCH_MAX_RUNS) {
+    printf("usage: %s [--cvm=<cvm binary>] [--runs=<n>] "
+           "[--mode=<cvm flag or step>] [--json=<file>] "
+           "[--compare=<earlier json>] [--label=<name>] <chaneque file>...\n",
+           argv[0]);
+    return 1;
+  }
+  if (modes_len == 0) {
+    modes[modes_len++] = "-t";
+  }
+
+  FILE *baseline = NULL;
+  if (compare_filename != NULL) {
+    baseline = fopen(compare_filename, "r");
+    if (baseline == NULL) {
+      perror("open baseline");
+      return 1;
+    }
+  }
+
+  struct bench_result *results =
+      calloc(programs_len * modes_len, sizeof(struct bench_result));
+  if (results == NULL) {
+    fprintf(stderr, "error: cannot allocate results\n");
+    return 1;
+  }
+
+  printf("%-24s %-6s %14s %16s %12s %10s%s\n", "program", "mode",
+         "instructions", "ns/insn", "Minsn/s", "peak KiB",
+         baseline != NULL ? "   vs base" : "");
+  fflush(stdout);
+  int failed = 0;
+  int unverified = 0;
+  size_t len = 0;
+  for (int i = 0; i < programs_len; i++) {
+    uint64_t instructions = 0;
+    if (bench_count(cvm, programs[i], &instructions) != 0) {
+      failed = 1;
+      continue;
+    }
+
+    // every mode has to end as the step interpreter does
+    char expected[BENCH_MAX_STACK];
+    int ignored = 0;
+    if (bench_once(cvm, programs[i], "step", expected, &ignored) != 0) {
+      failed = 1;
+      continue;
+    }
+
+    for (size_t j = 0; j < modes_len; j++) {
+      struct bench_result *result = &results[len];
+      result->instructions = instructions;
+      if (bench_run(cvm, programs[i], modes[j], expected, runs, result) !=
+          0) {
+        failed = 1;
+        continue;
+      }
+      len++;
+
+      char mode[64];
+      snprintf(mode, sizeof(mode), "%s%s", result->mode,
+               result->unverified ? "*" : "");
+      unverified |= result->unverified;
+      printf("%-24s %-6s %14" PRIu64 " %8.3f ±%6.3f %12.1f %10ld",
+             result->program, mode, result->instructions,
+             result->ns_per_insn, result->ns_per_insn_ci,
+             result->insns_per_sec / 1e6, result->peak_rss_kb);
+      double base = baseline != NULL
+                        ? bench_baseline(baseline, result->program,
+                                         result->mode)
+                        : 0;
+      if (base > 0) {
+        printf("   %+6.1f%%", (result->ns_per_insn / base - 1) * 100);
+      }
+      putchar('\n');
+      fflush(stdout);
+    }
+  }
+
+  if (unverified) {
+    printf("* code not verified, ran with the runtime checks\n");
+  }
+
+  if (json_filename != NULL) {
+    FILE *out = fopen(json_filename, "w");
+    if (out == NULL) {
+      perror("open json");
+      failed = 1;
+    } else {
+      bench_json(out, label, results, len);
+      if (fclose(out) != 0) {
+        perror("write json");
+        failed = 1;
+      }
+    }
+  }
+
+  if (baseline != NULL) {
+    fclose(baseline);
+  }
+  free(results);
+  return failed;
+}
@@ -72,32 +72,70 @@ enum mnemonic {
   LOAD,
   STORE,
   PSEG,
+  RESV,
+  FREE,
+  ARENA,
+  RESET,
+  PEEK,
+  POKE,
+  MEMCPY,
+  MEMSET,
+  MEMCMP,
   SETHDLR,
   SETERR,
   CLRERR,
-  DATA
+  NATIVE,
+  FFI_LIB_LOAD,
+  FFI_LIB_SELECT,
+  FFI_MAKE_EXTERN,
+  FFI_MAKE_DONE,
+  FFI_CALL,
+  VADD,
+  VMUL,
+  VFMA,
+  VCMP,
+  VSUM,
+  VMIN,
+  VMAX,
+  VDOT,
+  SPAWN,
+  YIELD,
+  JOIN,
+  OPEN,
+  READ,
+  WRITE,
+  CLOSE,
+  DATA,
+  IMPORT
 };
 
 struct instruction {
   const char *label;
   enum mnemonic mnemonic;
   enum mode mode;
+  enum mode width; // type moved by the memory instructions
   struct typed_value arg1;
+  struct typed_value arg2; // signature of IMPORT
   struct instruction *next;
   size_t feed_size;
   size_t offset;
   size_t size;
+  size_t line; // on the source, for the symbol file
 };
 
 struct label_location {
   const char *label;
   size_t offset;
-  struct label_location *next;
+  struct label_location *next;  // in the order of the source
+  struct label_location *chain; // on the same bucket of the table
 };
 
 struct source {
   struct instruction *instructions;
+  struct instruction *last; // where the parser appends
   struct label_location *label_locations;
+  struct label_location **labels; // hash table of label_locations
+  size_t labels_mask;             // buckets - 1, a power of two
   size_t output_size;
 };
 
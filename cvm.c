@@ -3,11 +3,16 @@
 #include <assert.h>
 #include <dlfcn.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 inline retcode vm_run_step(struct vm *vm) {
   assert(vm != NULL);
@@ -34,8 +39,13 @@ inline retcode vm_run_step(struct vm *vm) {
   uint8_t mode = decode_arg0(step);
   uint16_t arg1 = decode_arg1(step);
 
+  if (vm->trace != NULL) {
+    trace_insn(vm->trace, vm, vm->code_offset - 4, opcode, mode);
+  }
+
   // fill left, right arguments when needed from stack
-  if ((opcode >= ADD && opcode <= GE) || opcode == SETERR || opcode == PSEG) {
+  if ((opcode >= ADD && opcode <= GE) || opcode == SETERR || opcode == PSEG ||
+      opcode == POKE) {
     if (stack_pop(&vm->data, &right) == ERROR) {
       vm_set_error(vm, 0x10,
                    "missing stack right parameter (opcode=%02hhX, "
@@ -52,7 +62,8 @@ inline retcode vm_run_step(struct vm *vm) {
       return ERROR;
     }
   } else if ((opcode >= NOT && opcode <= JZ) || opcode == FFI_LIB_LOAD ||
-             opcode == FFI_LIB_SELECT) {
+             opcode == FFI_LIB_SELECT || opcode == FREE || opcode == PEEK ||
+             opcode == SPAWN || opcode == JOIN) {
     if (stack_pop(&vm->data, &left) == ERROR) {
       vm_set_error(vm, 0x11,
                    "missing stack parameter (opcode=%02hhX, "
@@ -62,17 +73,24 @@ inline retcode vm_run_step(struct vm *vm) {
     }
   }
 
+  // memory opcodes keep the type they move on the high nibble
+  uint8_t feed = mode;
+  if (opcode == LOAD || opcode == STORE) {
+    feed = mode & 0x0F;
+  }
+
   // fill aux param from arg0, next 32-bits or next 64-bits depending on mode
   if (opcode == PUSH || opcode == CALL || opcode == SETHDLR || opcode == LOAD ||
-      opcode == STORE || opcode == FFI_CALL ||
+      opcode == STORE || opcode == FFI_CALL || opcode == NATIVE ||
+      opcode == RESV || opcode == ARENA || opcode == SPAWN ||
       (opcode >= JNZ && opcode <= JMP)) {
-    if (mode == 0x00 || mode == 0x01) {
+    if (feed == 0x00 || feed == 0x01) {
       aux.u64 = arg1;
-    } else if (mode == 0x02) {
+    } else if (feed == 0x02) {
       curpos = vm->code + vm->code_offset;
       aux.u64 = decode_u32(curpos);
       vm->code_offset += 4;
-    } else if (mode == 0x03) {
+    } else if (feed == 0x03) {
       curpos = vm->code + vm->code_offset;
       aux.u64 = decode_u64(curpos);
       vm->code_offset += 8;
@@ -108,19 +126,18 @@ inline retcode vm_run_step(struct vm *vm) {
     }
   }
 
-#ifdef CVM_PSTEP
-  printf("read: %02hhX %02hhX %02hhX %02hhX\n", curpos[0], curpos[1], curpos[2],
-         curpos[3]);
-  printf("run: opcode=%02hhX, mode=%02hhX, arg1=%" PRIu64 "\n", opcode, mode,
-         aux.u64);
-#endif
-
   switch ((enum opcode)opcode) {
   case NOP:
     break;
   case HALT:
+    // a fiber ends and the vm goes on with the next one
+    if (fiber_current(vm) != 0) {
+      return fiber_exit(vm);
+    }
     vm->halted = 1;
-    printf("vm has been halted\n");
+    if (!vm->quiet) {
+      printf("vm has been halted\n");
+    }
     break;
   case CLRS:
     while (stack_pop(&vm->data, &aux) != ERROR)
@@ -290,17 +307,40 @@ inline retcode vm_run_step(struct vm *vm) {
     vm_jmp(vm, aux.size);
     break;
   case LOAD:
-    right.size = *(vm->code + aux.size);
-    if (stack_push(&vm->data, right) == ERROR) {
-      vm_set_error(vm, 0x20,
-                   "stack overflow on load "
+  case STORE: {
+    size_t width = insn_width(mode);
+    if (width == 0) {
+      vm_set_error(vm, 0x13,
+                   "unknown type to move "
                    "(opcode=%02hhX, "
                    "mode=%02hhX, arg1=%" PRIu64 ")",
                    opcode, mode, arg1);
       return ERROR;
     }
-    break;
-  case STORE:
+
+    if (aux.size > vm->code_size || vm->code_size - aux.size < width) {
+      vm_set_error(vm, 0x23,
+                   "memory access outside code segment "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    if (opcode == LOAD) {
+      right.u64 = 0LL;
+      memcpy(&right, vm->code + aux.size, width);
+      if (stack_push(&vm->data, right) == ERROR) {
+        vm_set_error(vm, 0x20,
+                     "stack overflow on load "
+                     "(opcode=%02hhX, "
+                     "mode=%02hhX, arg1=%" PRIu64 ")",
+                     opcode, mode, arg1);
+        return ERROR;
+      }
+      break;
+    }
+
     if (stack_pop(&vm->data, &right) == ERROR) {
       vm_set_error(vm, 0x21,
                    "empty stack for store "
@@ -310,18 +350,214 @@ inline retcode vm_run_step(struct vm *vm) {
       return ERROR;
     }
 
-    *(vm->code + aux.size) = right.u64;
-    break;
+    memcpy(vm->code + aux.size, &right, width);
+  } break;
   case PSEG:
+    if (!heap_is_reserved(&vm->heap, right.size, left.size)) {
+      vm_set_error(vm, 0x24,
+                   "memory access outside reserved memory "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
     printf("============= memory inspect =============\n");
     printf("output of %" PRIu64 " bytes of memory on "
            "%p: \n",
-           left.u64, vm->code + right.size);
+           left.u64, vm->heap.base + right.size);
     for (size_t i = 0; i < left.size; i++) {
-      printf("%02hhX ", (vm->code + right.size)[i]);
+      printf("%02hhX ", (vm->heap.base + right.size)[i]);
     }
     printf("\n====================================\n");
     break;
+  case RESV:
+  case ARENA: {
+    retcode reserved = opcode == RESV
+                           ? heap_alloc(&vm->heap, aux.size, &right.size)
+                           : heap_scratch(&vm->heap, aux.size, &right.size);
+    if (reserved == ERROR) {
+      vm_set_error(vm, 0x40,
+                   "out of memory reserving %zu bytes "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   aux.size, opcode, mode, arg1);
+      return ERROR;
+    }
+
+    if (stack_push(&vm->data, right) == ERROR) {
+      vm_set_error(vm, 0x20,
+                   "stack overflow on reserve "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+  } break;
+  case FREE:
+    if (heap_release(&vm->heap, left.size) == ERROR) {
+      vm_set_error(vm, 0x41,
+                   "cannot free %zu, it is not a reserved block "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   left.size, opcode, mode, arg1);
+      return ERROR;
+    }
+    break;
+  case RESET:
+    // mode 1 drops the RESV blocks too
+    heap_reset(&vm->heap, mode == 0x01);
+    break;
+  case PEEK:
+  case POKE: {
+    size_t width = insn_width(mode);
+    if (width == 0 || (mode & 0x0F) != 0x00) {
+      vm_set_error(vm, 0x13,
+                   "unknown type to move "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    size_t address = opcode == PEEK ? left.size : right.size;
+    if (!heap_is_reserved(&vm->heap, address, width)) {
+      vm_set_error(vm, 0x24,
+                   "memory access outside reserved memory "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    if (opcode == PEEK) {
+      right.u64 = 0LL;
+      memcpy(&right, vm->heap.base + address, width);
+      stack_push(&vm->data, right);
+    } else {
+      memcpy(vm->heap.base + address, &left, width);
+    }
+  } break;
+  case MEMCPY:
+  case MEMSET:
+  case MEMCMP: {
+    union value size = {0LL};
+    if (vm->data.top < 2) {
+      vm_set_error(vm, 0x10,
+                   "missing stack parameters "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    // destination (or first block), source (or byte, or second block), size
+    stack_pop(&vm->data, &size);
+    stack_pop(&vm->data, &right);
+    stack_pop(&vm->data, &left);
+    if (!heap_is_reserved(&vm->heap, left.size, size.size) ||
+        (opcode != MEMSET &&
+         !heap_is_reserved(&vm->heap, right.size, size.size))) {
+      vm_set_error(vm, 0x24,
+                   "memory access outside reserved memory "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    // the libc routines pick the widest vector unit of the cpu
+    uint8_t *base = vm->heap.base;
+    if (opcode == MEMCPY) {
+      memmove(base + left.size, base + right.size, size.size);
+    } else if (opcode == MEMSET) {
+      memset(base + left.size, right.u8, size.size);
+    } else {
+      int diff = memcmp(base + left.size, base + right.size, size.size);
+      aux.u64 = 0LL;
+      aux.i64 = (diff > 0) - (diff < 0);
+      stack_push(&vm->data, aux);
+    }
+  } break;
+  case VADD:
+  case VMUL:
+  case VFMA:
+  case VCMP:
+  case VSUM:
+  case VMIN:
+  case VMAX:
+  case VDOT: {
+    struct vector_args args = {.opcode = opcode, .mode = mode, .compare = arg1};
+    int reduce = opcode == VSUM || opcode == VMIN || opcode == VMAX;
+    int params = reduce ? 2 : opcode == VFMA ? 4 : 3;
+    size_t width = vector_width(mode);
+    if (width == 0 ||
+        (opcode == VCMP && (arg1 < NEQ || arg1 > GE || arg1 == 0x1E))) {
+      vm_set_error(vm, 0x13,
+                   "unknown type for vector "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    if (vm->data.top < params - 1) {
+      vm_set_error(vm, 0x10,
+                   "missing stack parameters "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    // array written (or left one), scale of VFMA, array read, length
+    union value len = {0LL};
+    stack_pop(&vm->data, &len);
+    if (opcode == VFMA) {
+      stack_pop(&vm->data, &args.scale);
+    }
+    stack_pop(&vm->data, &right);
+    if (!reduce) {
+      stack_pop(&vm->data, &left);
+    }
+
+    size_t size = len.size * width;
+    if (len.size > vm->heap.size / width ||
+        !heap_is_reserved(&vm->heap, right.size, size) ||
+        (!reduce && !heap_is_reserved(&vm->heap, left.size, size))) {
+      vm_set_error(vm, 0x24,
+                   "memory access outside reserved memory "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    if ((opcode == VMIN || opcode == VMAX) && len.size == 0) {
+      vm_set_error(vm, 0x25,
+                   "empty vector has no minimum or maximum "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    args.to = vm->heap.base + left.size;
+    args.from = vm->heap.base + right.size;
+    args.len = len.size;
+    if (vector_run(&args) == ERROR) {
+      vm_set_error(vm, 0x40,
+                   "out of memory for overlapping vectors "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    if (reduce || opcode == VDOT) {
+      stack_push(&vm->data, args.result);
+    }
+  } break;
   case SETHDLR:
     vm->error_handler = aux.size;
     break;
@@ -372,9 +608,124 @@ inline retcode vm_run_step(struct vm *vm) {
     vm->ffi_ext_exec_mode = 1;
     break;
   case FFI_CALL: {
-    // ffi_entry_point callable = (ffi_entry_point)(*(vm->code + aux.size));
-    // (*callable)(vm);
+    ffi_entry_point entry = ffi_entry(vm, aux.size);
+    if (entry == NULL) {
+      vm_set_error(vm, 0x67,
+                   "no extern to call "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    if (entry(vm) == ERROR) {
+      vm_set_error(vm, 0x10,
+                   "stack does not fit the extern call "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+  } break;
+  case NATIVE:
+    if (aux.size >= vm->natives_count || vm->natives[aux.size] == NULL) {
+      vm_set_error(vm, 0x68,
+                   "no native registered "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    // natives set their own error
+    if (vm->natives[aux.size](vm) == ERROR) {
+      return ERROR;
+    }
+    break;
+  case SPAWN: {
+    size_t id = 0;
+    if (aux.size % 4 != 0 || aux.size + 4 > vm->code_size) {
+      vm_set_error(vm, 0x80,
+                   "invalid fiber entry %lu "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   aux.size, opcode, mode, arg1);
+      return ERROR;
+    }
+    if (fiber_spawn(vm, aux.size, left, &id) == ERROR) {
+      vm_set_error(vm, 0x80,
+                   "cannot spawn fiber "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    // the argument was popped, so the id fits
+    vm->data.bot[++vm->data.top].u64 = id;
   } break;
+  case YIELD:
+    return fiber_yield(vm);
+  case JOIN:
+    return fiber_join(vm, left.size);
+  case OPEN:
+  case READ:
+  case WRITE:
+  case CLOSE: {
+    int params = opcode == CLOSE ? 1 : opcode == OPEN ? 2 : 3;
+    if (vm->data.top < params - 1) {
+      vm_set_error(vm, 0x10,
+                   "missing stack parameters "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    // file and range (READ, WRITE), path and flags (OPEN), or file (CLOSE)
+    struct io_args args = {.opcode = opcode};
+    union value len = {0LL};
+    if (opcode == READ || opcode == WRITE) {
+      stack_pop(&vm->data, &len);
+    }
+    stack_pop(&vm->data, &right);
+    if (opcode != CLOSE) {
+      stack_pop(&vm->data, &left);
+    }
+
+    int reserved = 0;
+    if (opcode == OPEN) {
+      // the path ends on the first null byte
+      uint8_t *end = NULL;
+      if (left.size < vm->heap.size) {
+        end = memchr(vm->heap.base + left.size, '\0',
+                     vm->heap.size - left.size);
+      }
+      args.buffer = vm->heap.base + left.size;
+      args.flags = right.i32;
+      reserved = end != NULL && heap_is_reserved(&vm->heap, left.size,
+                                                 end - args.buffer + 1);
+    } else if (opcode == CLOSE) {
+      args.fd = right.i32;
+      reserved = 1;
+    } else {
+      args.fd = left.i32;
+      args.buffer = vm->heap.base + right.size;
+      args.len = len.size;
+      reserved = heap_is_reserved(&vm->heap, right.size, len.size);
+    }
+    if (!reserved) {
+      vm_set_error(vm, 0x24,
+                   "memory access outside reserved memory "
+                   "(opcode=%02hhX, "
+                   "mode=%02hhX, arg1=%" PRIu64 ")",
+                   opcode, mode, arg1);
+      return ERROR;
+    }
+
+    // the fiber waits here, or the whole vm when there are no fibers
+    return io_request(vm, &args);
+  }
   default:
     printf("unrecognized or unsupported opc: %#02x, addr: %p\n", opcode,
            curpos);
@@ -395,86 +746,52 @@ inline retcode vm_run_step(struct vm *vm) {
   return SUCCESS;
 }
 
-retcode ffi_make_extern(struct vm *vm) {
-  assert(vm != NULL);
-  if (vm->ffi_ext_exec_mode != 0) {
-    vm_set_error(vm, 0x66,
-                 "FFI_MAKE_EXTERN called after FFI_MAKE_DONE, cannot create "
-                 "new FFI entries\n");
-    return ERROR;
-  }
-
-  union value v_argc = {.u64 = 0LL};
-  if (stack_pop(&vm->data, &v_argc) == ERROR) {
-    vm_set_error(vm, 0x64, "missing argc argument to build extern call\n");
-    return ERROR;
-  }
-
-  char *gen = vm->ffi_ext_page + vm->ffi_ext_page_used;
-  size_t write_cursor = 0LL;
-
-  union value v_name = {.u64 = 0LL};
-  if (stack_pop(&vm->data, &v_name) == ERROR) {
-    vm_set_error(vm, 0x64, "missing symbol name to build extern call\n");
-    return ERROR;
-  }
-
-  assert(v_name.data != NULL);
-  union value v_handler = vm->ffi_libs.bot[vm->ffi_selected_lib];
-  void *target_addr = dlsym(v_handler.data, v_name.data);
-  if (target_addr == NULL) {
-    vm_set_error(vm, 0x65,
-                 "cannot resolve symbol '%s' on current lib: %p, error: %s\n",
-                 v_name.data, v_handler, dlerror());
+/* Stacks are reserved at their full depth between two guard pages, the kernel
+ * only backs the pages that get touched. Slots end right at the upper guard
+ * page, so going past cap faults instead of writing after the stack. */
+retcode stack_init(struct stack *s, size_t cap) {
+  assert(s != NULL);
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t used = sizeof(union value) * (cap + 1);
+  size_t size = (used + page - 1) / page * page + 2 * page;
+  s->bot = NULL;
+  s->top = -1;
+  s->cap = -1;
+  s->base = mmap(NULL, size, PROT_NONE,
+                 MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  s->size = size;
+  if (s->base == MAP_FAILED) {
+    s->base = NULL;
     return ERROR;
   }
 
-  union value v_store_target = {.u64 = 0LL};
-  if (stack_pop(&vm->data, &v_store_target) == ERROR) {
-    vm_set_error(vm, 0x64, "missing store target extern call\n");
+  uint8_t *base = s->base;
+  if (mprotect(base + page, size - 2 * page, PROT_READ | PROT_WRITE) != 0) {
+    stack_free(s);
     return ERROR;
   }
 
-  printf("make extern: store target: %lu, target address: %p, argc: %d\n",
-         v_store_target.size, target_addr, v_argc.u32);
-
-  // push ebp
-  // mov ebp, esp
-  const char f_head[] = {0x55, 0x48, 0x89, 0xE5};
-  memcpy(gen + write_cursor, f_head, sizeof(f_head));
-  write_cursor += sizeof(f_head);
-
-  // call [addr]
-  const char f_call[] = {};
-  memcpy(gen + write_cursor, f_call, sizeof(f_call));
-  write_cursor += sizeof(f_call) + sizeof(void *);
-
-  // pop ebp
-  // ret
-  const char f_tail[] = {0x5D, 0xC3};
-  memcpy(gen + write_cursor, f_tail, sizeof(f_tail));
-  write_cursor += sizeof(f_tail);
-  vm->ffi_ext_page_used = write_cursor;
-
-  // Assign the entry point to the store target
-  *((ffi_entry_point *)vm->code + v_store_target.size) = (ffi_entry_point)gen;
-
-  ((ffi_entry_point)gen)(vm);
+  s->bot = (union value *)(base + size - page - used);
+  s->cap = cap;
   return SUCCESS;
 }
 
-void stack_init(struct stack *s, size_t cap) {
-  assert(s != NULL);
-  s->bot = malloc(sizeof(union value) * cap);
-  memset(s->bot, 0L, sizeof(union value) * cap);
-  s->cap = cap;
-  s->top = -1;
+void stack_free(struct stack *s) {
+  if (s->base != NULL) {
+    munmap(s->base, s->size);
+    s->base = NULL;
+  }
+  s->bot = NULL;
 }
 
-void stack_free(struct stack *s) {
-  if (s->bot != NULL) {
-    free(s->bot);
+// Whether address is on one of the guard pages of s
+static int stack_guarded(struct stack *s, uintptr_t address) {
+  uintptr_t base = (uintptr_t)s->base;
+  if (s->base == NULL || address < base || address >= base + s->size) {
+    return 0;
   }
+  return address < (uintptr_t)s->bot ||
+         address >= (uintptr_t)(s->bot + s->cap + 1);
 }
 
 void stack_print(struct stack *s) {
@@ -555,18 +872,33 @@ void stack_rot3(struct stack *s) {
   s->bot[s->top - 2] = a;
 }
 
-retcode vm_init(struct vm *vm, const char *filename) {
-  assert(vm != NULL);
-  assert(filename != NULL);
-
-  stack_init(&vm->data, 32);
-  stack_init(&vm->call, 32);
-  stack_init(&vm->ffi_libs, 4);
-  stack_init(&vm->ffi_externs, 4);
+// Machine state apart from the code
+static retcode vm_init_state(struct vm *vm) {
+  retcode stacks = stack_init(&vm->data, DEFAULT_DATA_DEPTH);
+  if (stack_init(&vm->call, DEFAULT_CALL_DEPTH) == ERROR ||
+      stack_init(&vm->ffi_libs, 4) == ERROR ||
+      stack_init(&vm->ffi_externs, 4) == ERROR) {
+    stacks = ERROR;
+  }
+  retcode heap = heap_init(&vm->heap, DEFAULT_HEAP_SIZE);
   vm->code = NULL;
+  vm->code_mapped = 0L;
+  vm->insns = NULL;
+  vm->insns_shared = 0;
+  vm->program = NULL;
+  vm->insns_count = 0L;
+  vm->insns_labels = NULL;
+  vm->verified = 0;
+  vm->fuse = 1;
+  vm->exec_mode = EXEC_STEP;
+  vm->jit = NULL;
+  vm->hot_threshold = DEFAULT_HOT_THRESHOLD;
+  vm->aot_lib = NULL;
+  vm->aot_run = NULL;
   vm->code_size = 0L;
   vm->code_offset = 0L;
   vm->halted = 0;
+  vm->quiet = 0;
   vm->error_handler = 0L;
   vm->error_message = NULL;
   vm->error_code = 0;
@@ -576,27 +908,31 @@ retcode vm_init(struct vm *vm, const char *filename) {
   vm->ffi_ext_page_size = 0L;
   vm->ffi_ext_page_used = 0L;
   vm->ffi_ext_exec_mode = 0;
-
-  FILE *file = fopen(filename, "rb");
-  if (file == NULL) {
-    perror("open file");
+  vm->ffi_imports = NULL;
+  vm->natives = NULL;
+  vm->natives_count = 0L;
+  vm->fibers = NULL;
+  vm->io = NULL;
+  vm->profile = NULL;
+  vm->trace = NULL;
+  if (stacks == ERROR) {
+    fprintf(stderr, "error: cannot reserve stacks\n");
+    return ERROR;
+  }
+  if (heap == ERROR) {
+    fprintf(stderr, "error: cannot reserve data segment\n");
     return ERROR;
   }
 
-  fseek(file, 0L, SEEK_END);
-  size_t filelen = ftell(file);
-  fseek(file, 0L, SEEK_SET);
+  return SUCCESS;
+}
 
-  uint8_t *buffer = malloc(sizeof(uint8_t) * filelen);
-  if (fread(buffer, sizeof(uint8_t), filelen, file) != filelen) {
-    fprintf(stderr, "error: could not read complete file!\n");
+// What depends on the code: its imports, self symbols and the ext page
+static retcode vm_init_code(struct vm *vm) {
+  if (ffi_imports_read(vm) == ERROR) {
     return ERROR;
   }
 
-  vm->code = buffer;
-  vm->code_size = filelen;
-  fclose(file);
-
   // Load self symbols
   union value vm_dl_handler = {.data = dlopen(NULL, RTLD_LAZY)};
   if (vm_dl_handler.data == NULL) {
@@ -605,38 +941,221 @@ retcode vm_init(struct vm *vm, const char *filename) {
   }
   stack_push(&vm->ffi_libs, vm_dl_handler);
 
-  // Create a new page to dump FFI code (JIT)
-  // TODO: remove prot_exec from here
-  vm->ffi_ext_page =
-      mmap(NULL, DEFAULT_EXT_PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
-           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-  vm->ffi_ext_page_size = DEFAULT_EXT_PAGE_SIZE;
+  // Create a new page to dump FFI code (JIT), executable after FFI_MAKE_DONE,
+  // with room for the imports as well
+  size_t page_size = DEFAULT_EXT_PAGE_SIZE +
+                     (ffi_imports_count(vm) * FFI_THUNK_SIZE +
+                      DEFAULT_EXT_PAGE_SIZE - 1) /
+                         DEFAULT_EXT_PAGE_SIZE * DEFAULT_EXT_PAGE_SIZE;
+  vm->ffi_ext_page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (vm->ffi_ext_page == MAP_FAILED) {
+    vm->ffi_ext_page = NULL;
+    fprintf(stderr, "error: cannot map the ffi page\n");
+    return ERROR;
+  }
+  vm->ffi_ext_page_size = page_size;
   vm->ffi_ext_page_used = 0LL;
   return SUCCESS;
 }
 
+retcode vm_init(struct vm *vm, const char *filename) {
+  return vm_init_file(vm, filename, 0);
+}
+
+retcode vm_init_file(struct vm *vm, const char *filename, int populate) {
+  assert(vm != NULL);
+  assert(filename != NULL);
+  if (vm_init_state(vm) == ERROR) {
+    return ERROR;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("open file");
+    return ERROR;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("stat file");
+    close(fd);
+    return ERROR;
+  }
+
+  // pages are read on the first touch, unless populate asks for all of them
+  // now, and as code is also memory they are private and copied on the first
+  // write, so the file never changes
+  static uint8_t no_code[4];
+  vm->code = no_code;
+  vm->code_size = st.st_size;
+  if (vm->code_size > 0) {
+    void *code = mmap(NULL, vm->code_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+    if (code == MAP_FAILED) {
+      perror("map file");
+      close(fd);
+      vm->code_size = 0L;
+      return ERROR;
+    }
+    vm->code = code;
+    vm->code_mapped = vm->code_size;
+  }
+  close(fd);
+  return vm_init_code(vm);
+}
+
+retcode vm_init_program(struct vm *vm, struct program *program) {
+  assert(vm != NULL);
+  assert(program != NULL);
+  if (vm_init_state(vm) == ERROR) {
+    return ERROR;
+  }
+
+  // same stacks and data segment as the program was prepared for
+  const struct vm *proto = program_proto(program);
+  if (((proto->data.cap != vm->data.cap || proto->call.cap != vm->call.cap) &&
+       vm_set_depth(vm, proto->data.cap, proto->call.cap) == ERROR) ||
+      (proto->heap.size != vm->heap.size &&
+       vm_set_heap(vm, proto->heap.size) == ERROR) ||
+      program_map(program, vm) == ERROR) {
+    return ERROR;
+  }
+
+  // the image has no import table left, the program made its externs
+  return vm_init_code(vm);
+}
+
+retcode vm_init_from_buffer(struct vm *vm, uint8_t *code, size_t size) {
+  assert(vm != NULL);
+  assert(code != NULL);
+  if (vm_init_state(vm) == ERROR) {
+    return ERROR;
+  }
+
+  // the caller owns the buffer, stores to memory write on it
+  vm->code = code;
+  vm->code_size = size;
+  return vm_init_code(vm);
+}
+
+// Stacks are only resized before running, values on them are dropped
+retcode vm_set_depth(struct vm *vm, size_t data_depth, size_t call_depth) {
+  assert(vm != NULL);
+  stack_free(&vm->data);
+  stack_free(&vm->call);
+  if (stack_init(&vm->data, data_depth) == ERROR ||
+      stack_init(&vm->call, call_depth) == ERROR) {
+    fprintf(stderr, "error: cannot reserve stacks of %zu and %zu values\n",
+            data_depth, call_depth);
+    return ERROR;
+  }
+
+  // verified code only fits the stacks it was verified for
+  vm->verified = 0;
+  return SUCCESS;
+}
+
+// The data segment is only resized before running, blocks on it are dropped
+retcode vm_set_heap(struct vm *vm, size_t size) {
+  assert(vm != NULL);
+  heap_free(&vm->heap);
+  if (heap_init(&vm->heap, size) == ERROR) {
+    fprintf(stderr, "error: cannot reserve a data segment of %zu bytes\n",
+            size);
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+static __thread struct vm *guard_vm;
+static __thread sigjmp_buf *guard_jmp;
+static pthread_once_t guard_once = PTHREAD_ONCE_INIT;
+static struct sigaction guard_previous; // of the host, before vm_guard
+
+static void vm_guard_handler(int sig, siginfo_t *info, void *context) {
+  uintptr_t address = (uintptr_t)info->si_addr;
+  struct vm *vm = guard_vm;
+  if (vm != NULL && (stack_guarded(&vm->data, address) ||
+                     stack_guarded(&vm->call, address))) {
+    siglongjmp(*guard_jmp, 1);
+  }
+
+  // not a stack of a guarded vm, it is a fault for the host
+  if ((guard_previous.sa_flags & SA_SIGINFO) &&
+      guard_previous.sa_sigaction != NULL) {
+    guard_previous.sa_sigaction(sig, info, context);
+  } else if (guard_previous.sa_handler != SIG_DFL &&
+             guard_previous.sa_handler != SIG_IGN) {
+    guard_previous.sa_handler(sig);
+  } else {
+    // fault again with the default action
+    sigaction(sig, &guard_previous, NULL);
+  }
+}
+
+static void vm_guard_install(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = vm_guard_handler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &guard_previous);
+}
+
+// While guard is set, faults on the guard pages of the stacks of vm jump to
+// it; clear it with NULL before its frame goes away
+void vm_guard(struct vm *vm, sigjmp_buf *guard) {
+  if (guard != NULL) {
+    pthread_once(&guard_once, vm_guard_install);
+  }
+
+  guard_vm = guard != NULL ? vm : NULL;
+  guard_jmp = guard;
+}
+
 void vm_free(struct vm *vm) {
-  if (vm->code != NULL) {
-    free(vm->code);
+  if (vm->code_mapped > 0) {
+    munmap(vm->code, vm->code_mapped);
+  }
+
+  if (vm->insns != NULL && !vm->insns_shared) {
+    free(vm->insns);
+  }
+
+  vm_jit_free(vm);
+
+  if (vm->aot_lib != NULL) {
+    dlclose(vm->aot_lib);
   }
 
   if (vm->error_message != NULL && vm->should_free_error) {
     free(vm->error_message);
   }
 
+  ffi_imports_free(vm);
+
   union value libref;
   while (stack_pop(&vm->ffi_libs, &libref) != ERROR) {
     dlclose(libref.data);
   }
 
+  io_free(vm);
+  fibers_free(vm);
+  profile_free(vm);
+  trace_free(vm);
   stack_free(&vm->data);
   stack_free(&vm->call);
   stack_free(&vm->ffi_libs);
   stack_free(&vm->ffi_externs);
+  heap_free(&vm->heap);
 
   if (vm->ffi_ext_page != NULL) {
     munmap(vm->ffi_ext_page, vm->ffi_ext_page_size);
   }
+
+  free(vm->natives);
+  program_release(vm->program);
 }
 
 void vm_set_error(struct vm *vm, int error_code, const char *user_format, ...) {
@@ -679,58 +1198,398 @@ inline retcode vm_jmp(struct vm *vm, size_t new_offset) {
   return ERROR;
 }
 
+retcode vm_raise(struct vm *vm) {
+  if (vm->error_handler == 0L) {
+    if (!vm->quiet) {
+      fprintf(stderr, "error: %s\n", vm->error_message);
+      fprintf(stderr, "error: handler not present, halting machine\n");
+    }
+    vm->halted = 1;
+    return ERROR;
+  }
+
+#ifdef CVM_PRINT_ALL_ERRORS
+  fprintf(stderr, "error: %s\n", vm->error_message);
+#endif
+  if (stack_push(&vm->data, (union value)vm->error_code) == ERROR) {
+    fprintf(stderr, "error: cannot push error code for handler\n");
+    vm->halted = 1;
+    return ERROR;
+  }
+
+  if (stack_push(&vm->call, (union value)vm->code_offset) == ERROR) {
+    fprintf(stderr, "error: cannot push return address for handler\n");
+    vm->halted = 1;
+    return ERROR;
+  }
+
+  vm_jmp(vm, vm->error_handler);
+  return SUCCESS;
+}
+
 retcode vm_run(struct vm *vm) {
+  if (ffi_imports_wait(vm) == ERROR) {
+    return ERROR;
+  }
+
+  if (vm->exec_mode == EXEC_THREADED) {
+    return vm_run_threaded(vm);
+  } else if (vm->exec_mode == EXEC_VERIFIED) {
+    return vm_run_verified(vm);
+  } else if (vm->exec_mode == EXEC_JIT) {
+    return vm_run_jit(vm);
+  } else if (vm->exec_mode == EXEC_TIERED) {
+    return vm_run_tiered(vm);
+  } else if (vm->exec_mode == EXEC_AOT) {
+    return vm_run_aot(vm);
+  } else if (vm->exec_mode == EXEC_PROFILE) {
+    return vm_run_profiled(vm);
+  }
+
   while (vm->halted == 0) {
     retcode rc = vm_run_step(vm);
-    if (rc == ERROR && vm->error_handler != 0L) {
-#ifdef CVM_PRINT_ALL_ERRORS
-      fprintf(stderr, "error: %s\n", vm->error_message);
-#endif
-      if (stack_push(&vm->data, (union value)vm->error_code) == ERROR) {
-        fprintf(stderr, "error: cannot push error code for handler\n");
-        vm->halted = 1;
-        return ERROR;
+    if (rc == ERROR && vm_raise(vm) == ERROR) {
+      return ERROR;
+    }
+  }
+
+  return SUCCESS;
+}
+
+#define BATCH_VALUES 16 // inputs and outputs of a job in batch mode
+
+struct batch_line {
+  union value inputs[BATCH_VALUES];
+  union value outputs[BATCH_VALUES];
+};
+
+// Reads a job for every line of stdin, numbers with a point are f64
+static size_t batch_read(struct batch_job *jobs, struct batch_line *lines,
+                         size_t count) {
+  char line[1024];
+  size_t read = 0;
+  while (read < count && fgets(line, sizeof(line), stdin) != NULL) {
+    struct batch_job *job = &jobs[read];
+    union value *inputs = lines[read].inputs;
+    job->inputs = inputs;
+    job->inputs_len = 0;
+    job->outputs = lines[read].outputs;
+    job->outputs_cap = BATCH_VALUES;
+    for (char *token = strtok(line, " \t\r\n"); token != NULL;
+         token = strtok(NULL, " \t\r\n")) {
+      if (job->inputs_len == BATCH_VALUES) {
+        break;
       }
 
-      if (stack_push(&vm->call, (union value)vm->code_offset) == ERROR) {
-        fprintf(stderr, "error: cannot push return address for handler\n");
-        vm->halted = 1;
-        return ERROR;
+      union value *value = &inputs[job->inputs_len++];
+      if (strchr(token, '.') != NULL) {
+        value->f64 = strtod(token, NULL);
+      } else if (token[0] == '-') {
+        value->i64 = strtoll(token, NULL, 0);
+      } else {
+        value->u64 = strtoull(token, NULL, 0);
       }
+    }
+    read++;
+  }
+  return read;
+}
 
-      vm_jmp(vm, vm->error_handler);
-    } else if (rc == ERROR) {
-      fprintf(stderr, "error: %s\n", vm->error_message);
-      fprintf(stderr, "error: handler not present, halting machine\n");
-      vm->halted = 1;
-      return ERROR;
+// Runs the program once for every line of stdin and prints the data stack
+// each run left, or its error, in the order of the lines
+static int batch_main(struct vm *proto, size_t workers, int lanes) {
+  if (proto->exec_mode == EXEC_AOT) {
+    fprintf(stderr, "error: batches do not run aot code\n");
+    vm_free(proto);
+    return 1;
+  }
+
+  proto->quiet = 1;
+  struct program *program = program_create(proto);
+  if (program == NULL) {
+    return 1;
+  }
+  struct pool *pool = pool_create(program, workers);
+  program_release(program);
+  if (pool == NULL) {
+    return 1;
+  }
+  if (pool_lanes(pool, lanes) == ERROR) {
+    pool_free(pool);
+    return 1;
+  }
+
+  // enough jobs in a chunk that workers rarely wait for each other
+  size_t count = pool_workers(pool) * 64;
+  struct batch_job *jobs = calloc(count, sizeof(struct batch_job));
+  struct batch_line *lines = calloc(count, sizeof(struct batch_line));
+  if (jobs == NULL || lines == NULL) {
+    fprintf(stderr, "error: cannot allocate batch\n");
+    free(lines);
+    free(jobs);
+    pool_free(pool);
+    return 1;
+  }
+
+  int failed = 0;
+  size_t read = 0;
+  while ((read = batch_read(jobs, lines, count)) > 0) {
+    pool_run(pool, jobs, read);
+    for (size_t i = 0; i < read; i++) {
+      if (jobs[i].error_code != 0) {
+        printf("error 0x%x\n", jobs[i].error_code);
+        failed = 1;
+        continue;
+      }
+      for (size_t j = 0; j < jobs[i].outputs_len; j++) {
+        printf(j == 0 ? "%" PRId64 : " %" PRId64, jobs[i].outputs[j].i64);
+      }
+      putchar('\n');
     }
   }
 
-  return SUCCESS;
+  free(lines);
+  free(jobs);
+  pool_free(pool);
+  return failed;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    printf("usage: %s <chaneque file>\n", argv[0]);
+  enum exec_mode exec_mode = EXEC_STEP;
+  int fuse = 1;
+  uint32_t hot_threshold = DEFAULT_HOT_THRESHOLD;
+  size_t data_depth = DEFAULT_DATA_DEPTH;
+  size_t call_depth = DEFAULT_CALL_DEPTH;
+  size_t heap_size = DEFAULT_HEAP_SIZE;
+  char *aot_filename = NULL;
+  char *emit_filename = NULL;
+  char *vector_unit = NULL;
+  char *ffi_cache = NULL;
+  char *profile_filename = NULL;
+  char *sample_filename = NULL;
+  char *symbols_filename = NULL;
+  unsigned sample_rate = DEFAULT_SAMPLE_RATE;
+  char *trace_filename = NULL;
+  size_t trace_size = DEFAULT_TRACE_SIZE;
+  int populate = 0;
+  int batch = 0;
+  int lanes = 0;
+  size_t workers = 0;
+  char *filename = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threaded") == 0) {
+      exec_mode = EXEC_THREADED;
+    } else if (strcmp(argv[i], "-V") == 0 ||
+               strcmp(argv[i], "--verify") == 0) {
+      exec_mode = EXEC_VERIFIED;
+    } else if (strcmp(argv[i], "-j") == 0 ||
+               strcmp(argv[i], "--jit") == 0) {
+      exec_mode = EXEC_JIT;
+    } else if (strcmp(argv[i], "-T") == 0 ||
+               strcmp(argv[i], "--tiered") == 0) {
+      exec_mode = EXEC_TIERED;
+    } else if (strncmp(argv[i], "--hot=", 6) == 0 && argv[i][6] != '\0') {
+      hot_threshold = strtoul(argv[i] + 6, NULL, 10);
+    } else if (strncmp(argv[i], "--data-depth=", 13) == 0 &&
+               argv[i][13] != '\0') {
+      data_depth = strtoul(argv[i] + 13, NULL, 10);
+    } else if (strncmp(argv[i], "--call-depth=", 13) == 0 &&
+               argv[i][13] != '\0') {
+      call_depth = strtoul(argv[i] + 13, NULL, 10);
+    } else if (strncmp(argv[i], "--heap-size=", 12) == 0 &&
+               argv[i][12] != '\0') {
+      heap_size = strtoul(argv[i] + 12, NULL, 10);
+    } else if (strncmp(argv[i], "--aot=", 6) == 0 && argv[i][6] != '\0') {
+      exec_mode = EXEC_AOT;
+      aot_filename = argv[i] + 6;
+    } else if (strncmp(argv[i], "--aot-emit=", 11) == 0 &&
+               argv[i][11] != '\0') {
+      emit_filename = argv[i] + 11;
+    } else if (strcmp(argv[i], "--no-fuse") == 0) {
+      fuse = 0;
+    } else if (strncmp(argv[i], "--vector=", 9) == 0 &&
+               argv[i][9] != '\0') {
+      vector_unit = argv[i] + 9;
+    } else if (strncmp(argv[i], "--ffi-cache=", 12) == 0 &&
+               argv[i][12] != '\0') {
+      ffi_cache = argv[i] + 12;
+    } else if (strncmp(argv[i], "--profile=", 10) == 0 &&
+               argv[i][10] != '\0') {
+      exec_mode = EXEC_PROFILE;
+      profile_filename = argv[i] + 10;
+    } else if (strncmp(argv[i], "--sample=", 9) == 0 && argv[i][9] != '\0') {
+      sample_filename = argv[i] + 9;
+    } else if (strncmp(argv[i], "--sample-rate=", 14) == 0 &&
+               argv[i][14] != '\0') {
+      sample_rate = strtoul(argv[i] + 14, NULL, 10);
+    } else if (strncmp(argv[i], "--symbols=", 10) == 0 &&
+               argv[i][10] != '\0') {
+      symbols_filename = argv[i] + 10;
+    } else if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8] != '\0') {
+      trace_filename = argv[i] + 8;
+    } else if (strncmp(argv[i], "--trace-size=", 13) == 0 &&
+               argv[i][13] != '\0') {
+      trace_size = strtoul(argv[i] + 13, NULL, 10);
+    } else if (strcmp(argv[i], "--populate") == 0) {
+      populate = 1;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = 1;
+    } else if (strcmp(argv[i], "--lanes") == 0) {
+      lanes = 1;
+    } else if (strncmp(argv[i], "--workers=", 10) == 0 &&
+               argv[i][10] != '\0') {
+      workers = strtoul(argv[i] + 10, NULL, 10);
+    } else if (filename == NULL && argv[i][0] != '-') {
+      filename = argv[i];
+    } else {
+      filename = NULL;
+      break;
+    }
+  }
+
+  if (filename == NULL) {
+    printf("usage: %s [-t|--threaded] [-V|--verify] [-j|--jit] "
+           "[-T|--tiered] [--hot=<hits>] [--data-depth=<values>] "
+           "[--call-depth=<calls>] [--heap-size=<bytes>] "
+           "[--aot=<so file>] "
+           "[--aot-emit=<c file>] [--no-fuse] [--vector=<unit>] "
+           "[--ffi-cache=<file>] [--profile=<report file>] "
+           "[--sample=<folded file>] [--sample-rate=<hz>] "
+           "[--symbols=<file>] [--trace=<dump file>] "
+           "[--trace-size=<records>] [--populate] [--batch] "
+           "[--workers=<threads>] [--lanes] <chaneque file>\n",
+           argv[0]);
+    return 1;
+  }
+
+  if (vector_unit != NULL && vector_select(vector_unit) == ERROR) {
     return 1;
   }
-  char *filename = argv[1];
+
   struct vm vm;
-  if (vm_init(&vm, filename) == ERROR) {
+  if (vm_init_file(&vm, filename, populate) == ERROR) {
     fprintf(stderr, "could not initialize vm\n");
     vm_free(&vm);
     return 1;
   }
 
-  if (vm_run(&vm) == ERROR) {
-    fprintf(stderr, "vm run failed\n");
+  // the imports resolve while the code is prepared
+  if (ffi_imports_start(&vm, ffi_cache) == ERROR) {
+    vm_free(&vm);
+    return 1;
+  }
+
+  // lanes run over the pre-decoded code
+  if (lanes && exec_mode == EXEC_STEP) {
+    exec_mode = EXEC_THREADED;
+  }
+
+  // the profile counts every instruction on its own
+  if (exec_mode == EXEC_PROFILE) {
+    fuse = 0;
+  }
+
+  vm.exec_mode = exec_mode;
+  vm.fuse = fuse;
+  vm.hot_threshold = hot_threshold;
+  if ((data_depth != DEFAULT_DATA_DEPTH || call_depth != DEFAULT_CALL_DEPTH) &&
+      vm_set_depth(&vm, data_depth, call_depth) == ERROR) {
+    vm_free(&vm);
+    return 1;
+  }
+  if (heap_size != DEFAULT_HEAP_SIZE && vm_set_heap(&vm, heap_size) == ERROR) {
+    vm_free(&vm);
+    return 1;
+  }
+  if (vm_register_natives(&vm) == ERROR) {
+    vm_free(&vm);
+    return 1;
+  }
+
+  if (batch && (exec_mode == EXEC_PROFILE || sample_filename != NULL)) {
+    fprintf(stderr, "error: batches cannot be profiled\n");
+    vm_free(&vm);
+    return 1;
+  }
+  if (batch && trace_filename != NULL) {
+    fprintf(stderr, "error: batches cannot be traced\n");
     vm_free(&vm);
     return 1;
   }
+  if (batch) {
+    return batch_main(&vm, workers, lanes);
+  }
+
+  if (emit_filename != NULL) {
+    FILE *out = fopen(emit_filename, "w");
+    if (out == NULL) {
+      perror("open aot file");
+      vm_free(&vm);
+      return 1;
+    }
+
+    retcode rc = vm_predecode(&vm);
+    if (rc == SUCCESS) {
+      rc = vm_aot_emit(&vm, out);
+    }
+    fclose(out);
+    vm_free(&vm);
+    return rc == SUCCESS ? 0 : 1;
+  }
+
+  if (exec_mode == EXEC_AOT && vm_aot_load(&vm, aot_filename) == ERROR) {
+    fprintf(stderr, "could not load aot code\n");
+    vm_free(&vm);
+    return 1;
+  }
+
+  if (exec_mode != EXEC_STEP && exec_mode != EXEC_AOT &&
+      vm_predecode(&vm) == ERROR) {
+    fprintf(stderr, "could not pre-decode code\n");
+    vm_free(&vm);
+    return 1;
+  }
+
+  if (exec_mode == EXEC_VERIFIED && vm_verify(&vm) == ERROR) {
+    fprintf(stderr, "code not verified, running with runtime checks\n");
+  }
+
+  if (trace_filename != NULL &&
+      trace_init(&vm, trace_filename, trace_size) == ERROR) {
+    vm_free(&vm);
+    return 1;
+  }
+
+  if (sample_filename != NULL && sample_start(&vm, sample_rate) == ERROR) {
+    vm_free(&vm);
+    return 1;
+  }
+
+  retcode rc = vm_run(&vm);
+  if (rc == ERROR) {
+    fprintf(stderr, "vm run failed\n");
+  }
+
+  if (sample_filename != NULL &&
+      sample_stop(&vm, sample_filename, symbols_filename) == ERROR) {
+    rc = ERROR;
+  }
+
+  // the trace matters the most when the run failed
+  if (trace_filename != NULL &&
+      trace_dump(&vm, rc == SUCCESS ? TRACE_HALT : TRACE_ERROR) == ERROR) {
+    perror("write trace");
+    rc = ERROR;
+  }
+
+  // failed runs are profiled as well
+  if (profile_filename != NULL &&
+      profile_write(&vm, profile_filename) == ERROR) {
+    rc = ERROR;
+  }
 
   vm_free(&vm);
-  return 0;
+  return rc == SUCCESS ? 0 : 1;
 }
 
 void dummy() { puts("C called from VM\n"); }
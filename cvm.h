@@ -1,8 +1,10 @@
 #ifndef CVM_H
 #define CVM_H
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 union value {
   uint8_t u8;
@@ -23,14 +25,136 @@ struct stack {
   union value *bot;
   int64_t top;
   int64_t cap;
+  void *base;  // reservation, guard pages included
+  size_t size; // bytes reserved
 };
 
+#define HEAP_CLASSES 32    // powers of two from HEAP_MIN_BLOCK bytes
+#define HEAP_MIN_BLOCK 16
+#define HEAP_POOL_SIZE 4096 // small classes are carved this many bytes at once
+
+struct heap {
+  uint8_t *base;             // data segment, apart from code
+  size_t size;               // bytes reserved
+  size_t top;                // end of the blocks given by RESV
+  size_t arena;              // start of the blocks given by ARENA
+  size_t free[HEAP_CLASSES]; // first free block of each class, or 0
+};
+
+// Operands of the vector opcodes, len counts elements of the mode
+struct vector_args {
+  uint8_t opcode;
+  uint8_t mode;
+  uint8_t compare;    // comparison opcode of VCMP
+  uint8_t *to;        // array written, or the left one of VDOT
+  const uint8_t *from;
+  union value scale;  // factor of VFMA
+  size_t len;
+  union value result; // of the reductions and VDOT
+};
+
+// Operands of the I/O opcodes, with the ranges on the data segment checked
+struct io_args {
+  uint8_t opcode;
+  int fd;
+  int flags;       // of OPEN
+  uint8_t *buffer; // path of OPEN, or the range read or written
+  size_t len;
+};
+
+struct insn {
+  const void *handler; // threaded handler, linked on first run
+  uint16_t op;         // internal operation, selects the handler
+  uint8_t opcode;
+  uint8_t mode;
+  uint16_t arg1;
+  union value imm;     // resolved immediate (arg1 or feed)
+  struct insn *target; // resolved jump target, NULL when not pre-resolvable
+  size_t offset;       // offset of this instruction on code
+  size_t next;         // offset of the next instruction
+  uint32_t reach;      // verified data stack growth of the callee (CALL)
+  uint32_t hits;       // times reached by a back-edge or a call (tiered)
+};
+
+enum exec_mode {
+  EXEC_STEP = 0,     // decode and run one instruction at a time
+  EXEC_THREADED = 1, // run over pre-decoded code with direct threading
+  EXEC_VERIFIED = 2, // threaded without runtime checks, for verified code
+  EXEC_JIT = 3,      // compiled to native code, see cvm_jit.c
+  EXEC_TIERED = 4,   // threaded until hot, then compiled to native code
+  EXEC_AOT = 5,      // translated ahead of time, see cvm_aot.c
+  EXEC_PROFILE = 6   // threaded with counters, see cvm_profile.c
+};
+
+struct profile_frame {
+  uint64_t start; // cycle counter when called
+  size_t slot;    // slot called
+};
+
+// Counters of the profiled mode, by slot of pre-decoded code
+struct profile {
+  uint64_t *counts;  // instructions run
+  uint64_t *calls;   // calls to the slot
+  uint64_t *cycles;  // inclusive cycles of the calls to the slot
+  uint64_t *handled; // errors handled starting on the slot
+  size_t slots;
+  struct profile_frame *frames; // calls on the call stack, by depth
+  size_t depth;
+};
+
+/* Execution trace, a ring with the last instructions run that is dumped when
+ * the vm stops or on a signal, see cvm_trace.c and cvmtrace.c */
+struct trace_record {
+  uint32_t offset;
+  uint8_t opcode;
+  uint8_t mode;
+  uint16_t depth; // calls on the call stack
+  uint64_t top;   // top of the data stack before running, or 0 when empty
+};
+
+enum trace_reason { TRACE_HALT, TRACE_ERROR, TRACE_SIGNAL };
+
+// Start of a dump, followed by the records from the oldest one
+struct trace_header {
+  char magic[8]; // CVMTRACE
+  uint32_t version;
+  uint32_t reason; // enum trace_reason
+  uint64_t total;  // records taken since the trace started
+  uint64_t count;  // records in the dump
+  int32_t error_code;
+  uint32_t record_size;
+};
+
+#define TRACE_MAGIC "CVMTRACE"
+#define TRACE_VERSION 1
+
+struct trace {
+  struct trace_record *records;
+  uint64_t mask;  // records - 1, a power of two
+  uint64_t total; // records taken, the next one goes to total & mask
+  const char *filename;
+};
+
+struct jit;
+struct program;
+struct fibers;
+struct io;
+struct vm;
+typedef enum retcode { ERROR, SUCCESS } retcode;
+typedef retcode (*aot_entry_point)(struct vm *);
+typedef retcode (*ffi_entry_point)(struct vm *);
+
 struct vm {
   uint8_t *code;
+  size_t code_mapped;       // bytes of the image mapped, 0 when borrowed
+  struct insn *insns;       // pre-decoded code, one slot per 4-byte word
+  int insns_shared;         // insns belong to the program, see vm_own_insns
+  struct program *program;  // shared image this vm runs, or NULL
   struct stack data;        // data stack, main operation source
   struct stack call;        // call stack, where return addresses are stored
   struct stack ffi_libs;    // dlopen handler for libs, string to address
   struct stack ffi_externs; // extern function declarations
+  struct heap heap;         // data segment, see cvm_heap.c
   size_t code_size;
   size_t code_offset;
   size_t error_handler;
@@ -38,11 +162,28 @@ struct vm {
   int should_free_error;
   int error_code;
   int halted;
+  int quiet; // no halt message nor errors on stderr, for batches
   int ffi_selected_lib;
   void *ffi_ext_page;
   size_t ffi_ext_page_used;
   size_t ffi_ext_page_size;
   int ffi_ext_exec_mode;
+  struct ffi_imports *ffi_imports; // import table of the image, or NULL
+  ffi_entry_point *natives; // host functions called by NATIVE, by index
+  size_t natives_count;
+  struct fibers *fibers;   // NULL until the first SPAWN or I/O
+  struct io *io;           // ring of the I/O opcodes, NULL until the first one
+  struct profile *profile; // counters of the profiled mode, or NULL
+  struct trace *trace;     // ring of the last instructions, or NULL
+  size_t insns_count;
+  const void *const *insns_labels; // handler table the records are linked to
+  int verified;                    // code passed vm_verify
+  int fuse;                        // apply superinstructions when decoding
+  enum exec_mode exec_mode;
+  struct jit *jit;        // native code, NULL until compiled
+  uint32_t hot_threshold; // hits before compiling a loop or callee (tiered)
+  void *aot_lib;          // shared object with code translated ahead of time
+  aot_entry_point aot_run;
 };
 
 enum opcode {
@@ -84,9 +225,18 @@ enum opcode {
   RET = 0x36,
 
   /* Memory stack */
+  RESV = 0x40,
+  FREE = 0x41,
+  ARENA = 0x42,
   LOAD = 0x43,
   STORE = 0x44,
   PSEG = 0x45,
+  RESET = 0x46,
+  PEEK = 0x47,
+  POKE = 0x48,
+  MEMCPY = 0x49,
+  MEMSET = 0x4A,
+  MEMCMP = 0x4B,
 
   /* Error handling */
   SETHDLR = 0x50,
@@ -99,12 +249,139 @@ enum opcode {
   FFI_MAKE_EXTERN = 0x62,
   FFI_MAKE_DONE = 0x63,
   FFI_CALL = 0x64,
+  NATIVE = 0x65,
+
+  /* Vector, on arrays of the data segment */
+  VADD = 0x70,
+  VMUL = 0x71,
+  VFMA = 0x72,
+  VCMP = 0x73,
+  VSUM = 0x74,
+  VMIN = 0x75,
+  VMAX = 0x76,
+  VDOT = 0x77,
+
+  /* Fibers, see cvm_fiber.c */
+  SPAWN = 0x80,
+  YIELD = 0x81,
+  JOIN = 0x82,
+
+  /* Asynchronous I/O, see cvm_io.c */
+  OPEN = 0x83,
+  READ = 0x84,
+  WRITE = 0x85,
+  CLOSE = 0x86,
 };
 
-typedef enum retcode { ERROR, SUCCESS } retcode;
-typedef void (*ffi_entry_point)(struct vm *);
+/* Comparisons that fuse with a following JZ/JNZ into compare-and-branch
+ * superinstructions */
+#define CVM_COMPARE_OPS(X)                                                     \
+  X(NEQ, !=)                                                                   \
+  X(EQ, ==)                                                                    \
+  X(LT, <)                                                                     \
+  X(LE, <=)                                                                    \
+  X(GT, >)                                                                     \
+  X(GE, >=)
+
+
+/* Value types by mode, X(opcode, symbol, mode, member) for each one */
+#define CVM_INT_TYPES(X, op, sym)                                              \
+  X(op, sym, 0x00, u8)                                                         \
+  X(op, sym, 0x01, u16)                                                        \
+  X(op, sym, 0x02, u32)                                                        \
+  X(op, sym, 0x03, u64)                                                        \
+  X(op, sym, 0x04, i8)                                                         \
+  X(op, sym, 0x05, i16)                                                        \
+  X(op, sym, 0x06, i32)                                                        \
+  X(op, sym, 0x07, i64)
+
+#define CVM_VALUE_TYPES(X, op, sym)                                            \
+  CVM_INT_TYPES(X, op, sym)                                                    \
+  X(op, sym, 0x08, f32)                                                        \
+  X(op, sym, 0x09, f64)
+
+/* Opcodes with one operation per mode (OP_ADD_u64, OP_LT_f64...), the types
+ * are the modes value_op or value_op_nof take */
+#define CVM_TYPED_OPS(X)                                                       \
+  CVM_VALUE_TYPES(X, ADD, +)                                                   \
+  CVM_VALUE_TYPES(X, SUB, -)                                                   \
+  CVM_VALUE_TYPES(X, DIV, /)                                                   \
+  CVM_VALUE_TYPES(X, MUL, *)                                                   \
+  CVM_INT_TYPES(X, MOD, %)                                                     \
+  CVM_INT_TYPES(X, AND, &)                                                     \
+  CVM_INT_TYPES(X, OR, |)                                                      \
+  CVM_INT_TYPES(X, XOR, ^)                                                     \
+  CVM_VALUE_TYPES(X, NEQ, !=)                                                  \
+  CVM_VALUE_TYPES(X, EQ, ==)                                                   \
+  CVM_VALUE_TYPES(X, LT, <)                                                    \
+  CVM_VALUE_TYPES(X, LE, <=)                                                   \
+  CVM_VALUE_TYPES(X, GT, >)                                                    \
+  CVM_VALUE_TYPES(X, GE, >=)
+
+#define CVM_TYPED_UNARY_OPS(X) CVM_INT_TYPES(X, NOT, ~)
+
+/* Memory opcodes take the type they move on the high nibble of the mode, and
+ * LOAD/STORE their feed on the low one. u8 is the plain opcode */
+#define CVM_WIDE_TYPES(X, op)                                                  \
+  X(op, =, 0x10, u16)                                                          \
+  X(op, =, 0x20, u32)                                                          \
+  X(op, =, 0x30, u64)                                                          \
+  X(op, =, 0x40, i8)                                                           \
+  X(op, =, 0x50, i16)                                                          \
+  X(op, =, 0x60, i32)                                                          \
+  X(op, =, 0x70, i64)                                                          \
+  X(op, =, 0x80, f32)                                                          \
+  X(op, =, 0x90, f64)
 
-void stack_init(struct stack *s, size_t cap);
+#define CVM_MEMORY_OPS(X)                                                      \
+  CVM_WIDE_TYPES(X, LOAD)                                                      \
+  CVM_WIDE_TYPES(X, STORE)                                                     \
+  CVM_WIDE_TYPES(X, PEEK)                                                      \
+  CVM_WIDE_TYPES(X, POKE)
+
+#define CVM_TYPED_OP(op, sym, mode, member) OP_##op##_##member,
+
+/* Superinstructions that include an arithmetic or comparison opcode have one
+ * operation per mode of it, in mode order from the one of u8 */
+#define CVM_COMPARE_BRANCH_OPS(op, sym)                                        \
+  CVM_VALUE_TYPES(CVM_TYPED_OP, op##_JZ, sym)                                  \
+  CVM_VALUE_TYPES(CVM_TYPED_OP, op##_JNZ, sym)                                 \
+  CVM_VALUE_TYPES(CVM_TYPED_OP, op##_JZ_POP, sym)                              \
+  CVM_VALUE_TYPES(CVM_TYPED_OP, op##_JNZ_POP, sym)
+
+#define CVM_COMPARE_BRANCH_FIRST(op, sym)                                      \
+  OP_##op##_JZ = OP_##op##_JZ_u8, OP_##op##_JNZ = OP_##op##_JNZ_u8,            \
+  OP_##op##_JZ_POP = OP_##op##_JZ_POP_u8,                                      \
+  OP_##op##_JNZ_POP = OP_##op##_JNZ_POP_u8,
+
+/* Internal operations of the threaded interpreter, every opcode is its own
+ * operation and the following are only used on pre-decoded code */
+enum insn_op {
+  OP_STEP = 0x100, // fallback to vm_run_step for this instruction
+
+  /* Specialized by mode when decoding, see insn_base_op */
+  CVM_TYPED_OPS(CVM_TYPED_OP)
+  CVM_TYPED_UNARY_OPS(CVM_TYPED_OP)
+  CVM_MEMORY_OPS(CVM_TYPED_OP)
+
+  /* Superinstructions, see cvm_fusion.def */
+  CVM_VALUE_TYPES(CVM_TYPED_OP, ADDI, +) // PUSH k; ADD
+  CVM_VALUE_TYPES(CVM_TYPED_OP, SUBI, -) // PUSH k; SUB
+  CVM_VALUE_TYPES(CVM_TYPED_OP, INCM, +) // LOAD x; PUSH k; ADD; STORE x
+  OP_JZ_POP,                             // JZ l; POP with a POP at l
+  OP_JNZ_POP,                            // JNZ l; POP with a POP at l
+  CVM_COMPARE_OPS(CVM_COMPARE_BRANCH_OPS) // <cmp>; JZ/JNZ l [; POP]
+  OP_COUNT,
+
+  /* Typed superinstructions by their first operation, as cvm_fusion.def
+   * names them */
+  OP_ADDI = OP_ADDI_u8,
+  OP_SUBI = OP_SUBI_u8,
+  OP_INCM = OP_INCM_u8,
+  CVM_COMPARE_OPS(CVM_COMPARE_BRANCH_FIRST)
+};
+
+retcode stack_init(struct stack *s, size_t cap);
 void stack_free(struct stack *s);
 void stack_print(struct stack *s);
 
@@ -113,18 +390,173 @@ retcode stack_pop(struct stack *s, union value *v);
 void stack_swap(struct stack *s);
 void stack_rot3(struct stack *s);
 
+retcode heap_init(struct heap *heap, size_t size);
+void heap_free(struct heap *heap);
+void heap_reset(struct heap *heap, int all);
+void heap_clear(struct heap *heap);
+retcode heap_alloc(struct heap *heap, size_t size, size_t *address);
+retcode heap_release(struct heap *heap, size_t address);
+retcode heap_scratch(struct heap *heap, size_t size, size_t *address);
+int heap_is_reserved(struct heap *heap, size_t address, size_t size);
+
+void vector_init(void);
+retcode vector_select(const char *name);
+size_t vector_width(uint8_t mode);
+retcode vector_run(struct vector_args *args);
+
 retcode vm_init(struct vm *vm, const char *filename);
+retcode vm_init_file(struct vm *vm, const char *filename, int populate);
+retcode vm_init_from_buffer(struct vm *vm, uint8_t *code, size_t size);
+retcode vm_init_program(struct vm *vm, struct program *program);
+retcode vm_set_depth(struct vm *vm, size_t data_depth, size_t call_depth);
+retcode vm_set_heap(struct vm *vm, size_t size);
+void vm_guard(struct vm *vm, sigjmp_buf *guard);
 void vm_free(struct vm *vm);
 void vm_set_error(struct vm *vm, int error_code, const char *user_format, ...);
 retcode vm_run_step(struct vm *vm);
 retcode vm_run(struct vm *vm);
+retcode vm_raise(struct vm *vm);
+
+retcode fiber_spawn(struct vm *vm, size_t entry, union value arg, size_t *id);
+size_t fiber_current(struct vm *vm);
+retcode fiber_yield(struct vm *vm);
+retcode fiber_park(struct vm *vm);
+void fiber_wake(struct vm *vm, size_t id);
+void fiber_resume(struct vm *vm, size_t id, union value result);
+retcode fiber_join(struct vm *vm, size_t id);
+retcode fiber_exit(struct vm *vm);
+void fibers_free(struct vm *vm);
+
+retcode io_request(struct vm *vm, const struct io_args *args);
+int io_pending(struct vm *vm);
+retcode io_wait(struct vm *vm);
+void io_drain(struct vm *vm);
+void io_free(struct vm *vm);
+
+struct program *program_create(struct vm *proto);
+struct program *program_retain(struct program *program);
+void program_release(struct program *program);
+retcode program_map(struct program *program, struct vm *vm);
+retcode program_reset(struct program *program, struct vm *vm);
+const struct vm *program_proto(struct program *program);
+
+// One evaluation of a batch, with values in and out of the data stack
+struct batch_job {
+  const union value *inputs; // pushed in order before running
+  size_t inputs_len;
+  union value *outputs; // data stack after running, bottom first
+  size_t outputs_cap;
+  size_t outputs_len;
+  int error_code; // 0, the error that stopped the vm, or -1
+};
+
+struct pool;
+struct pool *pool_create(struct program *program, size_t workers);
+retcode pool_lanes(struct pool *pool, int lanes);
+retcode pool_run(struct pool *pool, struct batch_job *jobs, size_t count);
+size_t pool_workers(struct pool *pool);
+void pool_free(struct pool *pool);
+
+#define LANES_WIDTH 8 // jobs run in lockstep, a u64 each in 512 bits
+
+struct lanes;
+struct lanes *lanes_create(const struct vm *proto);
+void lanes_free(struct lanes *lanes);
+uint32_t lanes_run(struct lanes *lanes, const struct vm *proto,
+                   struct batch_job **jobs, size_t count);
+void lanes_leave(struct lanes *lanes, size_t lane, struct vm *vm);
+
+retcode vm_predecode(struct vm *vm);
+retcode vm_own_insns(struct vm *vm);
+void vm_predecode_range(struct vm *vm, size_t from, size_t to);
+retcode vm_run_threaded(struct vm *vm);
+struct insn *insn_at(struct vm *vm, size_t offset);
+size_t insn_next(struct vm *vm, struct insn *insn);
+uint16_t insn_base_op(uint8_t opcode, uint8_t mode);
+size_t insn_width(uint8_t mode);
+
+void vm_fuse(struct vm *vm);
+void vm_refuse_range(struct vm *vm, size_t from, size_t to);
+size_t fusions_count(void);
+const char *fusion_name(size_t fusion);
+uint64_t fusion_profile(struct vm *vm, size_t fusion, const uint64_t *counts);
+
+retcode profile_init(struct vm *vm);
+retcode profile_write(struct vm *vm, const char *filename);
+void profile_free(struct vm *vm);
+retcode vm_run_profiled(struct vm *vm);
+
+retcode sample_start(struct vm *vm, unsigned hz);
+retcode sample_stop(struct vm *vm, const char *filename,
+                    const char *symbols_filename);
+
+retcode trace_init(struct vm *vm, const char *filename, size_t records);
+retcode trace_dump(struct vm *vm, enum trace_reason reason);
+void trace_free(struct vm *vm);
+
+struct symbol {
+  size_t offset;
+  char *name;  // of a label
+  size_t line; // on the source, for an instruction
+};
+
+struct symbols {
+  struct symbol *labels; // by offset
+  size_t labels_len;
+  struct symbol *lines; // by offset
+  size_t lines_len;
+};
+
+retcode symbols_load(struct symbols *symbols, const char *filename);
+const struct symbol *symbol_label(const struct symbols *symbols,
+                                  size_t offset);
+size_t symbol_line(const struct symbols *symbols, size_t offset);
+void symbols_free(struct symbols *symbols);
+
+retcode vm_verify(struct vm *vm);
+retcode vm_run_verified(struct vm *vm);
+
+retcode vm_jit_compile(struct vm *vm);
+retcode vm_jit_compile_region(struct vm *vm, size_t offset);
+void vm_jit_free(struct vm *vm);
+retcode vm_run_jit(struct vm *vm);
+retcode vm_run_counting(struct vm *vm);
+retcode vm_run_tiered(struct vm *vm);
+
+retcode vm_aot_emit(struct vm *vm, FILE *out);
+retcode vm_aot_load(struct vm *vm, const char *filename);
+retcode vm_run_aot(struct vm *vm);
 
 retcode vm_jmp(struct vm *vm, size_t new_offset);
 
 retcode ffi_make_extern(struct vm *vm);
+ffi_entry_point ffi_entry(struct vm *vm, size_t address);
+retcode ffi_imports_read(struct vm *vm);
+size_t ffi_imports_count(struct vm *vm);
+retcode ffi_imports_start(struct vm *vm, const char *cache);
+retcode ffi_imports_wait(struct vm *vm);
+void ffi_imports_free(struct vm *vm);
+retcode vm_register_native(struct vm *vm, size_t index,
+                           ffi_entry_point native);
+retcode vm_register_natives(struct vm *vm);
 
 #define MAX_ERROR_MESSAGE_LEN 255
 #define DEFAULT_EXT_PAGE_SIZE 4096
+
+/* Signature of FFI_MAKE_EXTERN: argc on the low byte, then the result
+ * (FFI_RESULT | mode, or 0 for none) and from bit 16 a nibble with the mode
+ * of each argument */
+#define FFI_MAX_ARGS 8
+#define FFI_RESULT 0x80
+#define FFI_ADDRESS 0x0A   // data segment address, passed as a pointer
+#define FFI_THUNK_SIZE 256 // bytes of the ext page for each extern
+#define MAX_NATIVES 0x10000 // indices NATIVE takes on arg1 or a feed
+#define DEFAULT_HOT_THRESHOLD 1000
+#define DEFAULT_DATA_DEPTH 32
+#define DEFAULT_CALL_DEPTH 32
+#define DEFAULT_HEAP_SIZE (64 << 20)
+#define DEFAULT_SAMPLE_RATE 1000 // samples a second of cpu time
+#define DEFAULT_TRACE_SIZE 4096  // records kept by the execution trace
 #define decode_u32(bytes)                                                      \
   (bytes[0] + ((uint32_t)bytes[1] << 8) + ((uint32_t)bytes[2] << 16) +         \
    ((uint32_t)bytes[3] << 24))
@@ -135,6 +567,22 @@ retcode ffi_make_extern(struct vm *vm);
       ((uint64_t)bytes[4] << 32) + ((uint64_t)bytes[5] << 40) +                \
       ((uint64_t)bytes[6] << 48) + ((uint64_t)bytes[7] << 56)
 
+/* Takes a trace record of the instruction about to run, the only stores the
+ * tracer makes while the vm runs. The count is stored after the record, so a
+ * dump made from a signal handler never takes a record half written */
+#define trace_insn(trace, vm, insn_offset, insn_opcode, insn_mode)             \
+  do {                                                                         \
+    struct trace_record *record =                                              \
+        &(trace)->records[(trace)->total & (trace)->mask];                     \
+    record->offset = (insn_offset);                                            \
+    record->opcode = (insn_opcode);                                            \
+    record->mode = (insn_mode);                                                \
+    record->depth = (vm)->call.top + 1;                                        \
+    record->top =                                                              \
+        (vm)->data.top >= 0 ? (vm)->data.bot[(vm)->data.top].u64 : 0LL;        \
+    __atomic_store_n(&(trace)->total, (trace)->total + 1, __ATOMIC_RELEASE);   \
+  } while (0)
+
 #define decode_step(bytes) decode_u32(bytes)
 #define decode_opcode(step) (step >> 24)
 #define decode_arg0(step) ((step & 0x00FF0000) >> 16)
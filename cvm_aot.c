@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Ahead of time translation of code to C. Every word of code gets a label
+ * and a translation of the instruction decoded there, so jumps are plain
+ * gotos and the operations use the union member of their mode directly.
+ * Anything that may fail or that has no translation goes to vm_run_step,
+ * which raises errors and runs the rare opcodes as usual. The result is
+ * built as a shared object against this same cvm.h. */
+
+static const char *const aot_members[] = {"u8",  "u16", "u32", "u64", "i8",
+                                          "i16", "i32", "i64", "f32", "f64"};
+
+static uint64_t aot_hash(const uint8_t *code, size_t size) {
+  uint64_t hash = 0xCBF29CE484222325ULL; // FNV-1a
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ code[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static const char *aot_symbol(uint8_t opcode) {
+  switch ((enum opcode)opcode) {
+  case ADD:
+    return "+";
+  case SUB:
+    return "-";
+  case DIV:
+    return "/";
+  case MUL:
+    return "*";
+  case MOD:
+    return "%";
+  case AND:
+    return "&";
+  case OR:
+    return "|";
+  case XOR:
+    return "^";
+  case NEQ:
+    return "!=";
+  case EQ:
+    return "==";
+  case LT:
+    return "<";
+  case LE:
+    return "<=";
+  case GT:
+    return ">";
+  case GE:
+    return ">=";
+  default:
+    return NULL;
+  }
+}
+
+// Modes value_op (or value_op_nof) takes for the opcode
+static int aot_mode_valid(uint8_t opcode, uint8_t mode) {
+  if (opcode == MOD || opcode == AND || opcode == OR || opcode == XOR ||
+      opcode == NOT) {
+    return mode <= 0x07;
+  }
+  return mode <= 0x09;
+}
+
+static void aot_goto(struct vm *vm, FILE *out, size_t offset) {
+  if (offset % 4 == 0 && offset / 4 < vm->insns_count) {
+    fprintf(out, "  goto L%zu;\n", offset);
+  } else {
+    fprintf(out, "  vm->code_offset = %zu;\n  goto dispatch;\n", offset);
+  }
+}
+
+static void aot_insn(struct vm *vm, FILE *out, struct insn *insn,
+                     int excluded) {
+  size_t at = insn->offset;
+  uint8_t opcode = insn->opcode;
+  const char *symbol = aot_symbol(opcode);
+
+  fprintf(out, "L%zu:\n", at);
+  if (excluded || insn->op == OP_STEP ||
+      ((symbol != NULL || opcode == NOT) &&
+       !aot_mode_valid(opcode, insn->mode)) ||
+      ((opcode == JNZ || opcode == JZ || opcode == JMP || opcode == CALL) &&
+       insn->target == NULL) ||
+      ((opcode == LOAD || opcode == STORE) &&
+       (insn->imm.size > vm->code_size ||
+        vm->code_size - insn->imm.size < insn_width(insn->mode)))) {
+    fprintf(out, "  STEP(%zu);\n", at);
+    return;
+  }
+
+  if (symbol != NULL) {
+    const char *member = aot_members[insn->mode];
+    fprintf(out, "  if (data->top < 1) STEP(%zu);\n", at);
+    if (opcode == DIV || opcode == MOD) {
+      fprintf(out, "  if (data->bot[data->top].u64 == 0) STEP(%zu);\n", at);
+    }
+    fprintf(out,
+            "  right = data->bot[data->top--];\n"
+            "  left = data->bot[data->top];\n"
+            "  aux.u64 = 0;\n"
+            "  aux.%s = left.%s %s right.%s;\n"
+            "  data->bot[data->top] = aux;\n",
+            member, member, symbol, member);
+    aot_goto(vm, out, insn->next);
+    return;
+  }
+
+  switch ((enum opcode)opcode) {
+  case NOP:
+    break;
+  case PUSH:
+    fprintf(out,
+            "  if (data->top >= data->cap) STEP(%zu);\n"
+            "  data->bot[++data->top].u64 = %" PRIu64 "ULL;\n",
+            at, insn->imm.u64);
+    break;
+  case POP:
+    fprintf(out, "  if (data->top < 0) STEP(%zu);\n  data->top--;\n", at);
+    break;
+  case SWAP:
+    fprintf(out,
+            "  if (data->top < 1) STEP(%zu);\n"
+            "  aux = data->bot[data->top];\n"
+            "  data->bot[data->top] = data->bot[data->top - 1];\n"
+            "  data->bot[data->top - 1] = aux;\n",
+            at);
+    break;
+  case ROT3:
+    fprintf(out,
+            "  if (data->top < 2) STEP(%zu);\n"
+            "  aux = data->bot[data->top];\n"
+            "  data->bot[data->top] = data->bot[data->top - 1];\n"
+            "  data->bot[data->top - 1] = data->bot[data->top - 2];\n"
+            "  data->bot[data->top - 2] = aux;\n",
+            at);
+    break;
+  case NOT:
+    fprintf(out,
+            "  if (data->top < 0) STEP(%zu);\n"
+            "  left = data->bot[data->top];\n"
+            "  aux.u64 = 0;\n"
+            "  aux.%s = ~left.%s;\n"
+            "  data->bot[data->top] = aux;\n",
+            at, aot_members[insn->mode], aot_members[insn->mode]);
+    break;
+  case JNZ:
+  case JZ:
+    fprintf(out,
+            "  if (data->top < 0) STEP(%zu);\n"
+            "  if (data->bot[data->top].u64 %s 0) goto L%zu;\n",
+            at, opcode == JZ ? "==" : "!=", insn->imm.size);
+    break;
+  case JMP:
+    fprintf(out, "  goto L%zu;\n", insn->imm.size);
+    return;
+  case CALL:
+    fprintf(out,
+            "  if (vm->call.top >= vm->call.cap) STEP(%zu);\n"
+            "  vm->call.bot[++vm->call.top].size = %zu;\n"
+            "  goto L%zu;\n",
+            at, insn->next, insn->imm.size);
+    return;
+  case RET:
+    fprintf(out,
+            "  if (vm->call.top < 0 ||\n"
+            "      vm->call.bot[vm->call.top].size > vm->code_size - 4)\n"
+            "    STEP(%zu);\n"
+            "  vm->code_offset = vm->call.bot[vm->call.top--].size;\n"
+            "  goto dispatch;\n",
+            at);
+    return;
+  case LOAD:
+    fprintf(out,
+            "  if (data->top >= data->cap) STEP(%zu);\n"
+            "  aux.u64 = 0;\n"
+            "  __builtin_memcpy(&aux, vm->code + %zu, %zu);\n"
+            "  data->bot[++data->top] = aux;\n",
+            at, insn->imm.size, insn_width(insn->mode));
+    break;
+  case STORE:
+    fprintf(out,
+            "  if (data->top < 0) STEP(%zu);\n"
+            "  __builtin_memcpy(vm->code + %zu, &data->bot[data->top--],\n"
+            "                   %zu);\n",
+            at, insn->imm.size, insn_width(insn->mode));
+    break;
+  case SETHDLR:
+    fprintf(out, "  vm->error_handler = %zu;\n", insn->imm.size);
+    break;
+  default:
+    fprintf(out, "  STEP(%zu);\n", at);
+    return;
+  }
+
+  aot_goto(vm, out, insn->next);
+}
+
+retcode vm_aot_emit(struct vm *vm, FILE *out) {
+  assert(vm != NULL);
+  assert(vm->insns != NULL);
+
+  // words any STORE writes on keep being interpreted from code
+  size_t count = vm->insns_count;
+  uint8_t *excluded = calloc(count + 1, sizeof(uint8_t));
+  if (excluded == NULL) {
+    fprintf(stderr, "error: cannot allocate aot translation\n");
+    return ERROR;
+  }
+
+  for (size_t slot = 0; slot < count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    if (insn->op == OP_STEP || insn->opcode != STORE) {
+      continue;
+    }
+
+    // the two words before the written ones may have feeds on them
+    size_t width = insn_width(insn->mode);
+    size_t first = insn->imm.size / 4 >= 2 ? insn->imm.size / 4 - 2 : 0;
+    size_t last = (insn->imm.size + width - 1) / 4;
+    for (size_t word = first; word <= last && word < count; word++) {
+      excluded[word] = 1;
+    }
+  }
+
+  fprintf(out,
+          "/* Generated by cvm --aot-emit, build it with\n"
+          " *   gcc -shared -fPIC -O2 -I<cvm sources> -o <file>.so <file>.c\n"
+          " * and run it with cvm --aot=<file>.so on the same code. */\n"
+          "#include \"cvm.h\"\n\n"
+          "const size_t cvm_aot_code_size = %zu;\n"
+          "const uint64_t cvm_aot_code_hash = 0x%016" PRIX64 "ULL;\n"
+          "const size_t cvm_aot_vm_size = sizeof(struct vm);\n\n"
+          "#define STEP(offset)                                           \\\n"
+          "  do {                                                         \\\n"
+          "    vm->code_offset = (offset);                                \\\n"
+          "    goto step;                                                 \\\n"
+          "  } while (0)\n\n"
+          "retcode cvm_aot_run(struct vm *vm) {\n",
+          vm->code_size, aot_hash(vm->code, vm->code_size));
+
+  fprintf(out, "  static const void *const labels[] = {\n");
+  for (size_t slot = 0; slot < count; slot++) {
+    fprintf(out, "      &&L%zu,\n", slot * 4);
+  }
+  fprintf(out, "      &&step};\n\n");
+
+  fprintf(out,
+          "  struct stack *data = &vm->data;\n"
+          "  union value aux = {0LL};\n"
+          "  union value left = {0LL};\n"
+          "  union value right = {0LL};\n\n"
+          "dispatch:\n"
+          "  if (vm->halted) {\n"
+          "    return SUCCESS;\n"
+          "  }\n"
+          "  if (vm->code_offset %% 4 == 0 && vm->code_offset / 4 < %zu) {\n"
+          "    goto *labels[vm->code_offset / 4];\n"
+          "  }\n\n"
+          "step: {\n"
+          "  uint8_t opcode = 0;\n"
+          "  if (vm->code_offset + 4 <= vm->code_size) {\n"
+          "    opcode = vm->code[vm->code_offset + 3];\n"
+          "  }\n"
+          "  if (vm_run_step(vm) == ERROR && vm_raise(vm) == ERROR) {\n"
+          "    return ERROR;\n"
+          "  }\n"
+          "  // externs are stored on code, which is not translated anymore\n"
+          "  if (opcode == FFI_MAKE_EXTERN) {\n"
+          "    return vm_run_threaded(vm);\n"
+          "  }\n"
+          "  goto dispatch;\n"
+          "}\n\n",
+          count);
+
+  for (size_t slot = 0; slot < count; slot++) {
+    aot_insn(vm, out, &vm->insns[slot], excluded[slot]);
+  }
+  fprintf(out, "}\n");
+
+  free(excluded);
+  if (ferror(out)) {
+    fprintf(stderr, "error: cannot write aot translation\n");
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+retcode vm_aot_load(struct vm *vm, const char *filename) {
+  assert(vm != NULL);
+  assert(filename != NULL);
+
+  void *lib = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    fprintf(stderr, "error: cannot load aot code: %s\n", dlerror());
+    return ERROR;
+  }
+
+  const size_t *code_size = dlsym(lib, "cvm_aot_code_size");
+  const uint64_t *code_hash = dlsym(lib, "cvm_aot_code_hash");
+  const size_t *vm_size = dlsym(lib, "cvm_aot_vm_size");
+  aot_entry_point run = (aot_entry_point)dlsym(lib, "cvm_aot_run");
+  if (code_size == NULL || code_hash == NULL || vm_size == NULL ||
+      run == NULL) {
+    fprintf(stderr, "error: %s is not aot code\n", filename);
+    dlclose(lib);
+    return ERROR;
+  }
+
+  if (*vm_size != sizeof(struct vm)) {
+    fprintf(stderr, "error: %s was built for another version of cvm\n",
+            filename);
+    dlclose(lib);
+    return ERROR;
+  }
+
+  if (*code_size != vm->code_size ||
+      *code_hash != aot_hash(vm->code, vm->code_size)) {
+    fprintf(stderr, "error: %s was built from different code\n", filename);
+    dlclose(lib);
+    return ERROR;
+  }
+
+  if (vm->aot_lib != NULL) {
+    dlclose(vm->aot_lib);
+  }
+  vm->aot_lib = lib;
+  vm->aot_run = run;
+  return SUCCESS;
+}
+
+retcode vm_run_aot(struct vm *vm) {
+  assert(vm != NULL);
+  if (vm->aot_run == NULL) {
+    return vm_run_threaded(vm);
+  }
+  return vm->aot_run(vm);
+}
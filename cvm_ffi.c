@@ -0,0 +1,720 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Extern calls. FFI_MAKE_EXTERN writes a System V x86-64 thunk for the
+ * signature of each extern on the ext page, one FFI_THUNK_SIZE slot each.
+ * Thunks take the vm, move the arguments from the data stack to the argument
+ * registers, call the symbol and push what it returns, so FFI_CALL is a
+ * single indirect call. The page is only writable until FFI_MAKE_DONE, which
+ * makes it executable. */
+
+// Registers, by their x86-64 encoding
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R9 9
+
+#define FIELD(member) offsetof(struct vm, member)
+#define DATA_FIELD(member) (FIELD(data) + offsetof(struct stack, member))
+#define HEAP_FIELD(member) (FIELD(heap) + offsetof(struct heap, member))
+
+static const int ffi_int_regs[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+struct ffi_buf {
+  uint8_t *bytes;
+  size_t len;
+  int failed;
+};
+
+static void emit(struct ffi_buf *b, const uint8_t *bytes, size_t len) {
+  if (b->len + len > FFI_THUNK_SIZE) {
+    b->failed = 1;
+    return;
+  }
+
+  memcpy(b->bytes + b->len, bytes, len);
+  b->len += len;
+}
+
+#define EMIT(b, ...)                                                           \
+  do {                                                                         \
+    const uint8_t emit_bytes[] = {__VA_ARGS__};                                \
+    emit(b, emit_bytes, sizeof(emit_bytes));                                   \
+  } while (0)
+
+static void emit_u32(struct ffi_buf *b, uint32_t v) {
+  EMIT(b, v, v >> 8, v >> 16, v >> 24);
+}
+
+static void emit_u64(struct ffi_buf *b, uint64_t v) {
+  emit_u32(b, v);
+  emit_u32(b, v >> 32);
+}
+
+// Jumps to the failure exit, patched once it is emitted
+static size_t emit_fail_jump(struct ffi_buf *b, uint8_t cc) {
+  EMIT(b, 0x0F, cc);
+  emit_u32(b, 0);
+  return b->len - 4;
+}
+
+static void patch_rel32(struct ffi_buf *b, size_t at, size_t to) {
+  if (b->failed) {
+    return;
+  }
+
+  uint32_t rel = (uint32_t)(to - (at + 4));
+  memcpy(b->bytes + at, &rel, sizeof(rel));
+}
+
+// Loads the argument of the mode from [rax + disp] to its register
+static void emit_argument(struct ffi_buf *b, uint8_t mode, int reg,
+                          int8_t disp) {
+  uint8_t rex = 0x40 | ((reg & 8) >> 1);
+  uint8_t modrm = 0x40 | ((reg & 7) << 3);
+  switch (mode) {
+  case 0x00:
+    EMIT(b, rex, 0x0F, 0xB6, modrm, disp); // movzx r32, byte
+    break;
+  case 0x01:
+    EMIT(b, rex, 0x0F, 0xB7, modrm, disp); // movzx r32, word
+    break;
+  case 0x02:
+    EMIT(b, rex, 0x8B, modrm, disp); // mov r32, dword
+    break;
+  case 0x04:
+    EMIT(b, rex | 0x08, 0x0F, 0xBE, modrm, disp); // movsx r64, byte
+    break;
+  case 0x05:
+    EMIT(b, rex | 0x08, 0x0F, 0xBF, modrm, disp); // movsx r64, word
+    break;
+  case 0x06:
+    EMIT(b, rex | 0x08, 0x63, modrm, disp); // movsxd r64, dword
+    break;
+  case 0x08:
+    EMIT(b, 0xF3, 0x0F, 0x10, modrm, disp); // movss xmm, dword
+    break;
+  case 0x09:
+    EMIT(b, 0xF2, 0x0F, 0x10, modrm, disp); // movsd xmm, qword
+    break;
+  default:
+    EMIT(b, rex | 0x08, 0x8B, modrm, disp); // mov r64, qword
+    break;
+  }
+
+  // data segment addresses are offsets, C wants the pointer
+  if (mode == FFI_ADDRESS) {
+    EMIT(b, rex | 0x08, 0x03, 0x83 | ((reg & 7) << 3)); // add r64, [rbx + ..]
+    emit_u32(b, HEAP_FIELD(base));
+  }
+}
+
+// Leaves the result of the mode on rax, as the data stack keeps it
+static void emit_result(struct ffi_buf *b, uint8_t mode) {
+  switch (mode) {
+  case 0x00:
+  case 0x04:
+    EMIT(b, 0x0F, 0xB6, 0xC0); // movzx eax, al
+    break;
+  case 0x01:
+  case 0x05:
+    EMIT(b, 0x0F, 0xB7, 0xC0); // movzx eax, ax
+    break;
+  case 0x02:
+  case 0x06:
+    EMIT(b, 0x89, 0xC0); // mov eax, eax
+    break;
+  case 0x08:
+    EMIT(b, 0x66, 0x0F, 0x7E, 0xC0); // movd eax, xmm0
+    break;
+  case 0x09:
+    EMIT(b, 0x66, 0x48, 0x0F, 0x7E, 0xC0); // movq rax, xmm0
+    break;
+  default:
+    break;
+  }
+}
+
+static retcode ffi_emit_thunk(struct ffi_buf *b, void *target, int argc,
+                              const uint8_t *modes, int result) {
+  EMIT(b, 0x53);             // push rbx
+  EMIT(b, 0x48, 0x89, 0xFB); // mov rbx, rdi
+  EMIT(b, 0x4C, 0x8B, 0x93); // mov r10, [rbx + data.bot]
+  emit_u32(b, DATA_FIELD(bot));
+  EMIT(b, 0x4C, 0x8B, 0x9B); // mov r11, [rbx + data.top]
+  emit_u32(b, DATA_FIELD(top));
+
+  // the arguments have to be there, or room for the result when there are
+  // none to pop
+  size_t fail = 0;
+  if (argc > 0) {
+    EMIT(b, 0x49, 0x83, 0xFB, argc - 1); // cmp r11, argc - 1
+    fail = emit_fail_jump(b, 0x8C);      // jl fail
+  } else if (result) {
+    EMIT(b, 0x4C, 0x3B, 0x9B); // cmp r11, [rbx + data.cap]
+    emit_u32(b, DATA_FIELD(cap));
+    fail = emit_fail_jump(b, 0x8D); // jge fail
+  }
+
+  // the last argument is on top of the stack
+  EMIT(b, 0x4B, 0x8D, 0x04, 0xDA); // lea rax, [r10 + r11 * 8]
+  int ints = 0;
+  int floats = 0;
+  for (int i = 0; i < argc; i++) {
+    int8_t disp = -8 * (argc - 1 - i);
+    if (modes[i] == 0x08 || modes[i] == 0x09) {
+      emit_argument(b, modes[i], floats++, disp);
+    } else {
+      emit_argument(b, modes[i], ffi_int_regs[ints++], disp);
+    }
+  }
+
+  EMIT(b, 0x49, 0xBB); // mov r11, target
+  emit_u64(b, (uint64_t)(uintptr_t)target);
+  EMIT(b, 0xB8); // mov eax, floats (for variadic functions)
+  emit_u32(b, floats);
+  EMIT(b, 0x41, 0xFF, 0xD3); // call r11
+  if (result) {
+    emit_result(b, result & 0x0F);
+  }
+
+  EMIT(b, 0x48, 0x8B, 0x8B); // mov rcx, [rbx + data.top]
+  emit_u32(b, DATA_FIELD(top));
+  if (argc > 0) {
+    EMIT(b, 0x48, 0x83, 0xE9, argc); // sub rcx, argc
+  }
+  if (result) {
+    EMIT(b, 0x48, 0xFF, 0xC1); // inc rcx
+    EMIT(b, 0x48, 0x8B, 0x93); // mov rdx, [rbx + data.bot]
+    emit_u32(b, DATA_FIELD(bot));
+    EMIT(b, 0x48, 0x89, 0x04, 0xCA); // mov [rdx + rcx * 8], rax
+  }
+  EMIT(b, 0x48, 0x89, 0x8B); // mov [rbx + data.top], rcx
+  emit_u32(b, DATA_FIELD(top));
+  EMIT(b, 0xB8); // mov eax, SUCCESS
+  emit_u32(b, SUCCESS);
+  EMIT(b, 0x5B, 0xC3); // pop rbx; ret
+
+  if (argc > 0 || result) {
+    patch_rel32(b, fail, b->len);
+    EMIT(b, 0xB8); // mov eax, ERROR
+    emit_u32(b, ERROR);
+    EMIT(b, 0x5B, 0xC3); // pop rbx; ret
+  }
+  return b->failed ? ERROR : SUCCESS;
+}
+
+// Splits a signature into argc, the result and the mode of each argument,
+// and tells whether the calling convention can take it
+static int ffi_signature(uint64_t signature, int *argc, int *result,
+                         uint8_t *modes) {
+  *argc = signature & 0xFF;
+  *result = (signature >> 8) & 0xFF;
+  int ints = 0;
+  int floats = 0;
+  int valid = *argc <= FFI_MAX_ARGS &&
+              (*result == 0 || (*result & ~0x0F) == FFI_RESULT) &&
+              (*result & 0x0F) <= 0x09;
+  for (int i = 0; valid && i < *argc; i++) {
+    modes[i] = (signature >> (16 + 4 * i)) & 0x0F;
+    if (modes[i] == 0x08 || modes[i] == 0x09) {
+      floats++;
+    } else {
+      ints++;
+    }
+    valid = modes[i] <= FFI_ADDRESS && ints <= 6 && floats <= 8;
+  }
+  return valid;
+}
+
+// Writes the thunk on the next slot of the page and stores its entry on code
+// at store, which the caller checked
+static retcode ffi_store_thunk(struct vm *vm, void *target, int argc,
+                               const uint8_t *modes, int result,
+                               size_t store) {
+  uint8_t *gen = (uint8_t *)vm->ffi_ext_page + vm->ffi_ext_page_used;
+  struct ffi_buf b = {.bytes = gen, .len = 0, .failed = 0};
+  if (ffi_emit_thunk(&b, target, argc, modes, result) == ERROR) {
+    return ERROR;
+  }
+
+  vm->ffi_ext_page_used += FFI_THUNK_SIZE;
+  memcpy(vm->code + store, &gen, sizeof(gen));
+  return SUCCESS;
+}
+
+retcode ffi_make_extern(struct vm *vm) {
+  assert(vm != NULL);
+  if (vm->ffi_ext_exec_mode != 0) {
+    vm_set_error(vm, 0x66,
+                 "FFI_MAKE_EXTERN called after FFI_MAKE_DONE, cannot create "
+                 "new FFI entries\n");
+    return ERROR;
+  }
+
+  union value v_signature = {.u64 = 0LL};
+  if (stack_pop(&vm->data, &v_signature) == ERROR) {
+    vm_set_error(vm, 0x64, "missing argc argument to build extern call\n");
+    return ERROR;
+  }
+
+  int argc = 0;
+  int result = 0;
+  uint8_t modes[FFI_MAX_ARGS] = {0};
+  if (!ffi_signature(v_signature.u64, &argc, &result, modes)) {
+    vm_set_error(vm, 0x64, "unsupported extern signature %016" PRIx64 "\n",
+                 v_signature.u64);
+    return ERROR;
+  }
+
+  union value v_name = {.u64 = 0LL};
+  if (stack_pop(&vm->data, &v_name) == ERROR) {
+    vm_set_error(vm, 0x64, "missing symbol name to build extern call\n");
+    return ERROR;
+  }
+
+  assert(v_name.data != NULL);
+  if (vm->ffi_selected_lib < 0 || vm->ffi_selected_lib > vm->ffi_libs.top) {
+    vm_set_error(vm, 0x65, "no lib selected to resolve symbol '%s'\n",
+                 v_name.data);
+    return ERROR;
+  }
+
+  union value v_handler = vm->ffi_libs.bot[vm->ffi_selected_lib];
+  void *target_addr = dlsym(v_handler.data, v_name.data);
+  if (target_addr == NULL) {
+    vm_set_error(vm, 0x65,
+                 "cannot resolve symbol '%s' on current lib: %p, error: %s\n",
+                 v_name.data, v_handler, dlerror());
+    return ERROR;
+  }
+
+  union value v_store_target = {.u64 = 0LL};
+  if (stack_pop(&vm->data, &v_store_target) == ERROR) {
+    vm_set_error(vm, 0x64, "missing store target extern call\n");
+    return ERROR;
+  }
+
+  if (v_store_target.size > vm->code_size ||
+      vm->code_size - v_store_target.size < sizeof(void *)) {
+    vm_set_error(vm, 0x64, "store target outside code segment\n");
+    return ERROR;
+  }
+
+  if (vm->ffi_ext_page_size - vm->ffi_ext_page_used < FFI_THUNK_SIZE) {
+    vm_set_error(vm, 0x66, "no room left for more FFI entries\n");
+    return ERROR;
+  }
+
+  if (ffi_store_thunk(vm, target_addr, argc, modes, result,
+                      v_store_target.size) == ERROR) {
+    vm_set_error(vm, 0x66, "extern call does not fit on its entry\n");
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+// Whether entry is the start of a thunk on the ext page of the vm
+static int ffi_is_thunk(const struct vm *vm, uint8_t *entry) {
+  uint8_t *page = vm->ffi_ext_page;
+  return vm->ffi_ext_exec_mode && entry >= page &&
+         entry < page + vm->ffi_ext_page_used &&
+         (size_t)(entry - page) % FFI_THUNK_SIZE == 0;
+}
+
+ffi_entry_point ffi_entry(struct vm *vm, size_t address) {
+  assert(vm != NULL);
+  if (address > vm->code_size || vm->code_size - address < sizeof(void *)) {
+    return NULL;
+  }
+
+  // code can write anything there, only the start of a thunk is called,
+  // and the imports of a program are on the page of the program
+  uint8_t *entry = NULL;
+  memcpy(&entry, vm->code + address, sizeof(entry));
+  if (!ffi_is_thunk(vm, entry) &&
+      (vm->program == NULL ||
+       !ffi_is_thunk(program_proto(vm->program), entry))) {
+    return NULL;
+  }
+  return (ffi_entry_point)entry;
+}
+
+/* Import table. An image may end with the externs it calls, which are made
+ * before running instead of with FFI_LIB_LOAD and FFI_MAKE_EXTERN:
+ *
+ *   entries  u64 signature, u32 store target, u16 library length, u16 symbol
+ *            length, then both names with their NUL, padded to 8 bytes
+ *   trailer  u32 count, u32 bytes of the entries, FFI_IMPORT_MAGIC
+ *
+ * An empty library stands for cvm itself. A thread opens the libraries and
+ * resolves the symbols while the code is prepared, and vm_run waits for it
+ * and writes the thunks. With a cache file, symbols are kept as offsets from
+ * the base of their library under its build-id, so warm starts skip dlsym. */
+
+#define FFI_IMPORT_ENTRY 16   // bytes of an entry before the names
+#define FFI_IMPORT_TRAILER 16 // bytes of the trailer
+#define FFI_IMPORT_MAGIC "CVMIMPT1"
+#define FFI_BUILD_ID 64 // hex digits kept of a build-id
+
+struct ffi_import {
+  const char *library;
+  const char *symbol;
+  uint64_t signature;
+  size_t store;
+  void *handle;
+  void *address;
+};
+
+struct ffi_cached {
+  char build_id[FFI_BUILD_ID + 1];
+  char *symbol;
+  uint64_t offset;
+};
+
+struct ffi_imports {
+  uint8_t *table; // copy of the entries, the names point here
+  struct ffi_import *entries;
+  size_t count;
+  const char *cache;
+  struct ffi_cached *cached;
+  size_t cached_count;
+  pthread_t thread;
+  int started;
+  int waited;
+  retcode resolved;
+  char error[MAX_ERROR_MESSAGE_LEN];
+};
+
+retcode ffi_imports_read(struct vm *vm) {
+  assert(vm != NULL);
+  vm->ffi_imports = NULL;
+  uint8_t *end = vm->code + vm->code_size;
+  if (vm->code_size < FFI_IMPORT_TRAILER ||
+      memcmp(end - 8, FFI_IMPORT_MAGIC, 8) != 0) {
+    return SUCCESS;
+  }
+
+  uint32_t count = 0;
+  uint32_t size = 0;
+  memcpy(&count, end - FFI_IMPORT_TRAILER, sizeof(count));
+  memcpy(&size, end - FFI_IMPORT_TRAILER + 4, sizeof(size));
+  if (size > vm->code_size - FFI_IMPORT_TRAILER ||
+      count > size / FFI_IMPORT_ENTRY) {
+    fprintf(stderr, "error: broken import table\n");
+    return ERROR;
+  }
+
+  struct ffi_imports *imports = calloc(1, sizeof(struct ffi_imports));
+  if (imports == NULL) {
+    fprintf(stderr, "error: cannot allocate import table\n");
+    return ERROR;
+  }
+  vm->ffi_imports = imports;
+  imports->table = malloc(size + 1);
+  imports->entries = calloc(count, sizeof(struct ffi_import));
+  if (imports->table == NULL || (count > 0 && imports->entries == NULL)) {
+    fprintf(stderr, "error: cannot allocate import table\n");
+    return ERROR;
+  }
+
+  // the last NUL keeps broken names from reading past the table
+  uint8_t *table = imports->table;
+  memcpy(table, end - FFI_IMPORT_TRAILER - size, size);
+  table[size] = '\0';
+  size_t at = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    struct ffi_import *entry = &imports->entries[i];
+    uint32_t store = 0;
+    uint16_t library_len = 0;
+    uint16_t symbol_len = 0;
+    if (size - at < FFI_IMPORT_ENTRY) {
+      fprintf(stderr, "error: broken import table\n");
+      return ERROR;
+    }
+    memcpy(&entry->signature, table + at, sizeof(uint64_t));
+    memcpy(&store, table + at + 8, sizeof(store));
+    memcpy(&library_len, table + at + 12, sizeof(library_len));
+    memcpy(&symbol_len, table + at + 14, sizeof(symbol_len));
+    at += FFI_IMPORT_ENTRY;
+    if (size - at < (size_t)library_len + symbol_len) {
+      fprintf(stderr, "error: broken import table\n");
+      return ERROR;
+    }
+
+    entry->store = store;
+    entry->library = (const char *)table + at;
+    entry->symbol = (const char *)table + at + library_len;
+    at += (library_len + symbol_len + 7) / 8 * 8;
+    at = at < size ? at : size;
+  }
+
+  imports->count = count;
+  vm->code_size -= size + FFI_IMPORT_TRAILER;
+  return SUCCESS;
+}
+
+size_t ffi_imports_count(struct vm *vm) {
+  return vm->ffi_imports != NULL ? vm->ffi_imports->count : 0;
+}
+
+struct ffi_build_id_search {
+  ElfW(Addr) base;
+  char *build_id;
+};
+
+static int ffi_find_build_id(struct dl_phdr_info *info, size_t size,
+                             void *data) {
+  (void)size;
+  struct ffi_build_id_search *search = data;
+  if (info->dlpi_addr != search->base) {
+    return 0;
+  }
+
+  for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_NOTE) {
+      continue;
+    }
+
+    // notes are 4-byte aligned name and desc after their header
+    uint8_t *note = (uint8_t *)(info->dlpi_addr + phdr->p_vaddr);
+    uint8_t *notes_end = note + phdr->p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= notes_end) {
+      ElfW(Nhdr) *header = (ElfW(Nhdr) *)note;
+      uint8_t *name = note + sizeof(ElfW(Nhdr));
+      uint8_t *desc = name + (header->n_namesz + 3) / 4 * 4;
+      if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0) {
+        size_t len = header->n_descsz < FFI_BUILD_ID / 2 ? header->n_descsz
+                                                          : FFI_BUILD_ID / 2;
+        for (size_t j = 0; j < len; j++) {
+          sprintf(search->build_id + 2 * j, "%02x", desc[j]);
+        }
+        return 1;
+      }
+      note = desc + (header->n_descsz + 3) / 4 * 4;
+    }
+  }
+  return 1;
+}
+
+// Base address and build-id of a library, or an empty build-id when it
+// has none
+static ElfW(Addr) ffi_library_id(void *handle, char *build_id) {
+  struct link_map *map = NULL;
+  build_id[0] = '\0';
+  if (dlinfo(handle, RTLD_DI_LINKMAP, &map) != 0 || map == NULL) {
+    return 0;
+  }
+
+  struct ffi_build_id_search search = {.base = map->l_addr,
+                                       .build_id = build_id};
+  dl_iterate_phdr(ffi_find_build_id, &search);
+  return map->l_addr;
+}
+
+static void ffi_cache_load(struct ffi_imports *imports) {
+  FILE *file = fopen(imports->cache, "r");
+  if (file == NULL) {
+    return;
+  }
+
+  char build_id[FFI_BUILD_ID + 1];
+  char symbol[256];
+  uint64_t offset = 0;
+  size_t cap = 0;
+  while (fscanf(file, "%64s %255s %" SCNx64, build_id, symbol, &offset) ==
+         3) {
+    if (imports->cached_count == cap) {
+      cap = cap == 0 ? 64 : cap * 2;
+      struct ffi_cached *cached =
+          realloc(imports->cached, sizeof(struct ffi_cached) * cap);
+      if (cached == NULL) {
+        break;
+      }
+      imports->cached = cached;
+    }
+
+    struct ffi_cached *entry = &imports->cached[imports->cached_count];
+    entry->symbol = strdup(symbol);
+    if (entry->symbol == NULL) {
+      break;
+    }
+    strcpy(entry->build_id, build_id);
+    entry->offset = offset;
+    imports->cached_count++;
+  }
+  fclose(file);
+}
+
+static struct ffi_cached *ffi_cache_find(struct ffi_imports *imports,
+                                         const char *build_id,
+                                         const char *symbol) {
+  for (size_t i = 0; i < imports->cached_count; i++) {
+    struct ffi_cached *entry = &imports->cached[i];
+    if (strcmp(entry->build_id, build_id) == 0 &&
+        strcmp(entry->symbol, symbol) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void *ffi_imports_resolve(void *data) {
+  struct ffi_imports *imports = data;
+  FILE *misses = NULL;
+  if (imports->cache != NULL) {
+    ffi_cache_load(imports);
+  }
+
+  for (size_t i = 0; i < imports->count; i++) {
+    struct ffi_import *entry = &imports->entries[i];
+    const char *library = entry->library[0] != '\0' ? entry->library : NULL;
+    entry->handle = dlopen(library, RTLD_NOW);
+    if (entry->handle == NULL) {
+      snprintf(imports->error, sizeof(imports->error),
+               "cannot load library: %s", dlerror());
+      imports->resolved = ERROR;
+      break;
+    }
+
+    // a library without build-id can change under the same name
+    char build_id[FFI_BUILD_ID + 1];
+    ElfW(Addr) base = ffi_library_id(entry->handle, build_id);
+    struct ffi_cached *cached = NULL;
+    if (imports->cache != NULL && build_id[0] != '\0') {
+      cached = ffi_cache_find(imports, build_id, entry->symbol);
+    }
+    if (cached != NULL) {
+      entry->address = (void *)(base + cached->offset);
+      continue;
+    }
+
+    entry->address = dlsym(entry->handle, entry->symbol);
+    if (entry->address == NULL) {
+      snprintf(imports->error, sizeof(imports->error),
+               "cannot resolve symbol '%s' on '%s'", entry->symbol,
+               entry->library);
+      imports->resolved = ERROR;
+      break;
+    }
+
+    if (imports->cache != NULL && build_id[0] != '\0') {
+      misses = misses != NULL ? misses : fopen(imports->cache, "a");
+      if (misses != NULL) {
+        fprintf(misses, "%s %s %" PRIx64 "\n", build_id, entry->symbol,
+                (uint64_t)((uintptr_t)entry->address - base));
+      }
+    }
+  }
+
+  if (misses != NULL) {
+    fclose(misses);
+  }
+  return NULL;
+}
+
+retcode ffi_imports_start(struct vm *vm, const char *cache) {
+  assert(vm != NULL);
+  struct ffi_imports *imports = vm->ffi_imports;
+  if (imports == NULL || imports->started) {
+    return SUCCESS;
+  }
+
+  imports->cache = cache;
+  imports->resolved = SUCCESS;
+  if (pthread_create(&imports->thread, NULL, ffi_imports_resolve, imports) !=
+      0) {
+    fprintf(stderr, "error: cannot start resolving imports\n");
+    return ERROR;
+  }
+  imports->started = 1;
+  return SUCCESS;
+}
+
+retcode ffi_imports_wait(struct vm *vm) {
+  assert(vm != NULL);
+  struct ffi_imports *imports = vm->ffi_imports;
+  if (imports == NULL || imports->waited) {
+    return SUCCESS;
+  }
+
+  if (!imports->started && ffi_imports_start(vm, NULL) == ERROR) {
+    return ERROR;
+  }
+  pthread_join(imports->thread, NULL);
+  imports->waited = 1;
+  if (imports->resolved == ERROR) {
+    fprintf(stderr, "error: %s\n", imports->error);
+    return ERROR;
+  }
+
+  for (size_t i = 0; i < imports->count; i++) {
+    struct ffi_import *entry = &imports->entries[i];
+    int argc = 0;
+    int result = 0;
+    uint8_t modes[FFI_MAX_ARGS] = {0};
+    if (!ffi_signature(entry->signature, &argc, &result, modes)) {
+      fprintf(stderr, "error: unsupported signature %016" PRIx64 " of %s\n",
+              entry->signature, entry->symbol);
+      return ERROR;
+    }
+    if (entry->store > vm->code_size ||
+        vm->code_size - entry->store < sizeof(void *)) {
+      fprintf(stderr, "error: store target of %s outside code segment\n",
+              entry->symbol);
+      return ERROR;
+    }
+    if (vm->ffi_ext_page_size - vm->ffi_ext_page_used < FFI_THUNK_SIZE ||
+        ffi_store_thunk(vm, entry->address, argc, modes, result,
+                        entry->store) == ERROR) {
+      fprintf(stderr, "error: no room for the entry of %s\n", entry->symbol);
+      return ERROR;
+    }
+    if (vm->insns != NULL) {
+      vm_predecode_range(vm, entry->store, entry->store + sizeof(void *));
+    }
+  }
+
+  // the image made all its externs
+  mprotect(vm->ffi_ext_page, vm->ffi_ext_page_size, PROT_READ | PROT_EXEC);
+  vm->ffi_ext_exec_mode = 1;
+  return SUCCESS;
+}
+
+void ffi_imports_free(struct vm *vm) {
+  struct ffi_imports *imports = vm->ffi_imports;
+  if (imports == NULL) {
+    return;
+  }
+
+  if (imports->started && !imports->waited) {
+    pthread_join(imports->thread, NULL);
+  }
+  for (size_t i = 0; i < imports->count; i++) {
+    if (imports->entries[i].handle != NULL) {
+      dlclose(imports->entries[i].handle);
+    }
+  }
+  for (size_t i = 0; i < imports->cached_count; i++) {
+    free(imports->cached[i].symbol);
+  }
+  free(imports->cached);
+  free(imports->entries);
+  free(imports->table);
+  free(imports);
+  vm->ffi_imports = NULL;
+}
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Fibers, cooperative threads of one vm. They share the code and the data
+ * segment, and each one has its own data and call stacks and code offset,
+ * which is all a switch saves on the fiber left and loads from the next one,
+ * so it costs about as much as an instruction. Fiber 0 is the vm itself,
+ * with the stacks it was made with, and the rest have small stacks of their
+ * own, kept for the next fiber spawned once they are joined. Fibers ready
+ * to run wait on a queue, and the running one only leaves the vm on YIELD,
+ * when it waits (JOIN on a fiber still running, I/O, or fiber_park) and when
+ * it ends with HALT. A HALT on fiber 0 halts the whole vm. When every fiber
+ * waits, the vm waits for its I/O (see cvm_io.c) to wake one up. */
+
+#define FIBER_DATA_DEPTH 32
+#define FIBER_CALL_DEPTH 32
+#define FIBER_NONE SIZE_MAX
+
+enum fiber_state { FIBER_FREE, FIBER_READY, FIBER_WAITING, FIBER_DONE };
+
+struct fiber {
+  struct stack data;
+  struct stack call;
+  size_t code_offset;
+  union value *slots; // both stacks, NULL for fiber 0
+  union value result; // top of the data stack when it ended
+  size_t joiner;      // fiber waiting for this one to end
+  size_t next;        // on the run queue or the free list
+  enum fiber_state state;
+};
+
+struct fibers {
+  struct fiber *all;
+  size_t len;
+  size_t cap;
+  size_t current;
+  size_t head; // run queue
+  size_t tail;
+  size_t free; // ended fibers already joined
+};
+
+static void fiber_enqueue(struct fibers *fibers, size_t id) {
+  struct fiber *fiber = &fibers->all[id];
+  fiber->state = FIBER_READY;
+  fiber->next = FIBER_NONE;
+  if (fibers->tail == FIBER_NONE) {
+    fibers->head = id;
+  } else {
+    fibers->all[fibers->tail].next = id;
+  }
+  fibers->tail = id;
+}
+
+static size_t fiber_dequeue(struct fibers *fibers) {
+  size_t id = fibers->head;
+  if (id != FIBER_NONE) {
+    fibers->head = fibers->all[id].next;
+    if (fibers->head == FIBER_NONE) {
+      fibers->tail = FIBER_NONE;
+    }
+  }
+  return id;
+}
+
+static void fiber_switch(struct vm *vm, size_t to) {
+  struct fibers *fibers = vm->fibers;
+  struct fiber *from = &fibers->all[fibers->current];
+  from->data = vm->data;
+  from->call = vm->call;
+  from->code_offset = vm->code_offset;
+
+  struct fiber *fiber = &fibers->all[to];
+  vm->data = fiber->data;
+  vm->call = fiber->call;
+  vm->code_offset = fiber->code_offset;
+  fibers->current = to;
+}
+
+// The first spawn makes the vm fiber 0
+static retcode fibers_init(struct vm *vm) {
+  struct fibers *fibers = calloc(1, sizeof(struct fibers));
+  if (fibers == NULL) {
+    return ERROR;
+  }
+
+  fibers->cap = 16;
+  fibers->all = calloc(fibers->cap, sizeof(struct fiber));
+  if (fibers->all == NULL) {
+    free(fibers);
+    return ERROR;
+  }
+
+  fibers->len = 1;
+  fibers->head = fibers->tail = fibers->free = FIBER_NONE;
+  fibers->all[0].joiner = FIBER_NONE;
+  fibers->all[0].state = FIBER_READY;
+  vm->fibers = fibers;
+  return SUCCESS;
+}
+
+static retcode fiber_alloc(struct fibers *fibers, size_t *id) {
+  if (fibers->free != FIBER_NONE) {
+    *id = fibers->free;
+    fibers->free = fibers->all[*id].next;
+    return SUCCESS;
+  }
+
+  if (fibers->len == fibers->cap) {
+    size_t cap = fibers->cap * 2;
+    struct fiber *all = realloc(fibers->all, sizeof(struct fiber) * cap);
+    if (all == NULL) {
+      return ERROR;
+    }
+    fibers->all = all;
+    fibers->cap = cap;
+  }
+
+  // the stacks have no guard pages, code with fibers is never verified and
+  // the checked paths check every push
+  struct fiber *fiber = &fibers->all[fibers->len];
+  memset(fiber, 0, sizeof(struct fiber));
+  fiber->slots =
+      malloc(sizeof(union value) * (FIBER_DATA_DEPTH + FIBER_CALL_DEPTH + 2));
+  if (fiber->slots == NULL) {
+    return ERROR;
+  }
+  fiber->data.bot = fiber->slots;
+  fiber->data.cap = FIBER_DATA_DEPTH;
+  fiber->call.bot = fiber->slots + FIBER_DATA_DEPTH + 1;
+  fiber->call.cap = FIBER_CALL_DEPTH;
+  *id = fibers->len++;
+  return SUCCESS;
+}
+
+retcode fiber_spawn(struct vm *vm, size_t entry, union value arg, size_t *id) {
+  assert(vm != NULL);
+  assert(id != NULL);
+  if (vm->fibers == NULL && fibers_init(vm) == ERROR) {
+    return ERROR;
+  }
+
+  struct fibers *fibers = vm->fibers;
+  if (fiber_alloc(fibers, id) == ERROR) {
+    return ERROR;
+  }
+
+  struct fiber *fiber = &fibers->all[*id];
+  fiber->data.top = 0;
+  fiber->data.bot[0] = arg;
+  fiber->call.top = -1;
+  fiber->code_offset = entry;
+  fiber->result.u64 = 0LL;
+  fiber->joiner = FIBER_NONE;
+  fiber_enqueue(fibers, *id);
+  return SUCCESS;
+}
+
+size_t fiber_current(struct vm *vm) {
+  assert(vm != NULL);
+  return vm->fibers != NULL ? vm->fibers->current : 0;
+}
+
+retcode fiber_yield(struct vm *vm) {
+  assert(vm != NULL);
+  struct fibers *fibers = vm->fibers;
+  if (fibers == NULL || fibers->head == FIBER_NONE) {
+    return SUCCESS;
+  }
+
+  fiber_enqueue(fibers, fibers->current);
+  fiber_switch(vm, fiber_dequeue(fibers));
+  return SUCCESS;
+}
+
+// Takes the next fiber to run, waiting for the I/O of the vm while none is
+// ready
+static retcode fiber_next(struct vm *vm, size_t *next) {
+  struct fibers *fibers = vm->fibers;
+  while (fibers->head == FIBER_NONE && io_pending(vm)) {
+    if (io_wait(vm) == ERROR) {
+      return ERROR;
+    }
+  }
+
+  *next = fiber_dequeue(fibers);
+  if (*next == FIBER_NONE) {
+    vm_set_error(vm, 0x82, "every fiber is waiting");
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+retcode fiber_park(struct vm *vm) {
+  assert(vm != NULL);
+  if (vm->fibers == NULL && fibers_init(vm) == ERROR) {
+    vm_set_error(vm, 0x82, "cannot park fiber");
+    return ERROR;
+  }
+
+  // a fiber woken while it parks runs again without a switch
+  struct fibers *fibers = vm->fibers;
+  size_t next = FIBER_NONE;
+  fibers->all[fibers->current].state = FIBER_WAITING;
+  if (fiber_next(vm, &next) == ERROR) {
+    fibers->all[fibers->current].state = FIBER_READY;
+    return ERROR;
+  }
+  fiber_switch(vm, next);
+  return SUCCESS;
+}
+
+void fiber_wake(struct vm *vm, size_t id) {
+  assert(vm != NULL && vm->fibers != NULL);
+  assert(id < vm->fibers->len);
+  if (vm->fibers->all[id].state == FIBER_WAITING) {
+    fiber_enqueue(vm->fibers, id);
+  }
+}
+
+void fiber_resume(struct vm *vm, size_t id, union value result) {
+  assert(vm != NULL && vm->fibers != NULL);
+  assert(id < vm->fibers->len);
+  struct fibers *fibers = vm->fibers;
+  struct stack *data = &fibers->all[id].data;
+  if (id == fibers->current) {
+    data = &vm->data;
+  }
+
+  // the fiber popped the operands of what it waited for, so the result fits
+  data->bot[++data->top] = result;
+  fiber_wake(vm, id);
+}
+
+retcode fiber_join(struct vm *vm, size_t id) {
+  assert(vm != NULL);
+  struct fibers *fibers = vm->fibers;
+  struct fiber *fiber = NULL;
+  if (fibers != NULL && id != 0 && id < fibers->len &&
+      id != fibers->current) {
+    fiber = &fibers->all[id];
+  }
+  if (fiber == NULL || fiber->state == FIBER_FREE ||
+      fiber->joiner != FIBER_NONE) {
+    vm_set_error(vm, 0x81, "no fiber %lu to join", id);
+    return ERROR;
+  }
+
+  if (fiber->state == FIBER_DONE) {
+    fiber->state = FIBER_FREE;
+    fiber->next = fibers->free;
+    fibers->free = id;
+    return stack_push(&vm->data, fiber->result);
+  }
+
+  // the result is pushed when the fiber ends
+  fiber->joiner = fibers->current;
+  if (fiber_park(vm) == ERROR) {
+    fiber->joiner = FIBER_NONE;
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+retcode fiber_exit(struct vm *vm) {
+  assert(vm != NULL);
+  struct fibers *fibers = vm->fibers;
+  assert(fibers != NULL && fibers->current != 0);
+  struct fiber *fiber = &fibers->all[fibers->current];
+  fiber->result.u64 = 0LL;
+  if (vm->data.top >= 0) {
+    fiber->result = vm->data.bot[vm->data.top];
+  }
+  fiber->state = FIBER_DONE;
+
+  size_t joiner = fiber->joiner;
+  if (joiner != FIBER_NONE) {
+    // the joiner popped the id, so there is room for the result
+    struct fiber *waiting = &fibers->all[joiner];
+    waiting->data.bot[++waiting->data.top] = fiber->result;
+    fiber->state = FIBER_FREE;
+    fiber->next = fibers->free;
+    fibers->free = fibers->current;
+    fiber_enqueue(fibers, joiner);
+  }
+
+  size_t next = FIBER_NONE;
+  if (fiber_next(vm, &next) == SUCCESS) {
+    fiber_switch(vm, next);
+    return SUCCESS;
+  }
+
+  // nothing can wake the vm up again, the error goes to fiber 0
+  fiber_switch(vm, 0);
+  return ERROR;
+}
+
+void fibers_free(struct vm *vm) {
+  assert(vm != NULL);
+  struct fibers *fibers = vm->fibers;
+  if (fibers == NULL) {
+    return;
+  }
+
+  // the vm keeps the stacks it was made with
+  if (fibers->current != 0) {
+    fiber_switch(vm, 0);
+  }
+  for (size_t i = 1; i < fibers->len; i++) {
+    free(fibers->all[i].slots);
+  }
+  free(fibers->all);
+  free(fibers);
+  vm->fibers = NULL;
+}
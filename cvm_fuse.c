@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Peephole pass over pre-decoded code: the head of a known sequence gets the
+ * superinstruction as its operation, everything else stays as decoded so
+ * jumping into the middle of a sequence still works and the handlers can go
+ * back to the plain instruction when a runtime check does not hold. */
+
+// Bytes a sequence may span: four instructions with 64-bit feeds
+#define FUSION_MAX_SPAN 48
+#define FUSION_MAX_LEN 4
+
+struct fusion {
+  uint16_t op;
+  const char *name;
+  uint64_t count;
+  int len;
+  uint8_t opcodes[FUSION_MAX_LEN];
+};
+
+static const struct fusion fusions[] = {
+#define FUSION(op, count, len, a, b, c, d) {op, #op, count, len, {a, b, c, d}},
+#include "cvm_fusion.def"
+#undef FUSION
+};
+
+static const size_t fusions_len = sizeof(fusions) / sizeof(fusions[0]);
+
+// Typed superinstructions include an arithmetic or comparison opcode, and
+// have one operation per mode of it from the one of u8
+static int fusion_typed(const struct fusion *fusion) {
+  for (int i = 0; i < fusion->len; i++) {
+    if (fusion->opcodes[i] >= ADD && fusion->opcodes[i] <= GE) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Mode of the arithmetic or comparison of the sequence on head, 0 for the
+// untyped ones
+static uint8_t fusion_mode(struct vm *vm, struct insn *head,
+                           const struct fusion *fusion) {
+  struct insn *cur = head;
+  for (int i = 0; i < fusion->len; i++) {
+    if (cur->opcode >= ADD && cur->opcode <= GE) {
+      return cur->mode;
+    }
+    cur = &vm->insns[cur->next >> 2];
+  }
+  return 0;
+}
+
+static int fusion_matches(struct vm *vm, struct insn *head,
+                          const struct fusion *fusion) {
+  struct insn *cur = head;
+  struct insn *prev = NULL;
+  for (int i = 0; i < fusion->len; i++) {
+    if (cur->op == OP_STEP || cur->opcode != fusion->opcodes[i]) {
+      return 0;
+    }
+
+    if ((cur->opcode == JZ || cur->opcode == JNZ) && cur->target == NULL) {
+      return 0;
+    }
+
+    // popping the operand of a branch has to happen on both of its ways
+    if (cur->opcode == POP && prev != NULL &&
+        (prev->opcode == JZ || prev->opcode == JNZ) &&
+        (prev->target->op == OP_STEP || prev->target->opcode != POP)) {
+      return 0;
+    }
+
+    prev = cur;
+    cur = &vm->insns[cur->next >> 2];
+  }
+
+  // incrementing memory only makes sense on the loaded byte
+  if (fusion->op == OP_INCM &&
+      (head->imm.size != prev->imm.size || (head->mode & 0xF0) != 0 ||
+       (prev->mode & 0xF0) != 0)) {
+    return 0;
+  }
+
+  // only value types have typed operations
+  return !fusion_typed(fusion) || fusion_mode(vm, head, fusion) <= 0x09;
+}
+
+static uint64_t fusion_saved(const struct fusion *fusion) {
+  return fusion->count * (fusion->len - 1);
+}
+
+static void fuse_slot(struct vm *vm, size_t slot) {
+  struct insn *head = &vm->insns[slot];
+  const struct fusion *best = NULL;
+  if (head->op == OP_STEP) {
+    return;
+  }
+  for (size_t i = 0; i < fusions_len; i++) {
+    if (fusions[i].opcodes[0] == head->opcode &&
+        (best == NULL || fusion_saved(&fusions[i]) > fusion_saved(best)) &&
+        fusion_matches(vm, head, &fusions[i])) {
+      best = &fusions[i];
+    }
+  }
+
+  if (best != NULL) {
+    head->op = best->op + fusion_mode(vm, head, best);
+    if (vm->insns_labels != NULL) {
+      head->handler = vm->insns_labels[head->op];
+    }
+  }
+}
+
+void vm_fuse(struct vm *vm) {
+  assert(vm != NULL);
+  assert(vm->insns != NULL);
+  for (size_t slot = 0; slot < vm->insns_count; slot++) {
+    fuse_slot(vm, slot);
+  }
+}
+
+// Whether the sequence fused on slot includes one of the changed words
+static int fusion_reaches(struct vm *vm, size_t slot, size_t changed) {
+  int len = FUSION_MAX_LEN;
+  uint16_t op = vm->insns[slot].op;
+  for (size_t i = 0; i < fusions_len; i++) {
+    const struct fusion *fusion = &fusions[i];
+    if (op >= fusion->op &&
+        op <= fusion->op + (fusion_typed(fusion) ? 0x09 : 0)) {
+      len = fusion->len;
+      break;
+    }
+  }
+
+  for (int i = 0; i < len && slot < vm->insns_count; i++) {
+    if (slot >= changed) {
+      return 1;
+    }
+    slot = vm->insns[slot].next >> 2;
+  }
+  return 0;
+}
+
+// The words of [from, to) were decoded again with other records: sequences
+// fused before them that include them are matched again on the code as it is
+// now, and so are the new records. Sequences that end before them are left as
+// they are.
+void vm_refuse_range(struct vm *vm, size_t from, size_t to) {
+  assert(vm != NULL);
+  assert(vm->insns != NULL);
+  if (to <= from) {
+    return;
+  }
+
+  size_t changed = from / 4;
+  size_t first = from >= FUSION_MAX_SPAN ? (from - FUSION_MAX_SPAN) / 4 : 0;
+  size_t last = (to - 1) / 4;
+  for (size_t slot = first; slot <= last && slot < vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    if (slot < changed &&
+        (insn->op < OP_ADDI || !fusion_reaches(vm, slot, changed))) {
+      continue;
+    }
+
+    if (insn->op >= OP_ADDI) {
+      insn->op = insn_base_op(insn->opcode, insn->mode);
+      if (vm->insns_labels != NULL) {
+        insn->handler = vm->insns_labels[insn->op];
+      }
+    }
+    if (vm->fuse) {
+      fuse_slot(vm, slot);
+    }
+  }
+}
+
+size_t fusions_count(void) { return fusions_len; }
+
+const char *fusion_name(size_t fusion) {
+  assert(fusion < fusions_len);
+  return fusions[fusion].name;
+}
+
+// Times the sequence ran back to back, the count for cvm_fusion.def, on the
+// counts of a profile taken without fusing: the fewest runs of its
+// instructions, at each place it matches
+uint64_t fusion_profile(struct vm *vm, size_t fusion, const uint64_t *counts) {
+  assert(vm != NULL);
+  assert(vm->insns != NULL);
+  assert(fusion < fusions_len);
+  const struct fusion *pattern = &fusions[fusion];
+  uint64_t total = 0;
+  for (size_t slot = 0; slot < vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    if (!fusion_matches(vm, insn, pattern)) {
+      continue;
+    }
+
+    // a POP after a branch runs on both of its ways, so the branch counts
+    uint64_t runs = counts[slot];
+    for (int i = 1; i < pattern->len; i++) {
+      struct insn *prev = insn;
+      insn = &vm->insns[insn->next >> 2];
+      if (insn->opcode == POP && (prev->opcode == JZ || prev->opcode == JNZ)) {
+        continue;
+      }
+      if (counts[insn - vm->insns] < runs) {
+        runs = counts[insn - vm->insns];
+      }
+    }
+    total += runs;
+  }
+  return total;
+}
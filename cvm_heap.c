@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Data segment, apart from code. It is reserved at once and the kernel only
+ * backs the pages that get touched. RESV blocks grow up from the start and
+ * come in power of two size classes, each with a free list, and the small
+ * ones are carved a whole pool at a time. ARENA blocks grow down from the end
+ * with a bump pointer and are only released all together by RESET. Addresses
+ * are offsets on the segment, and 0 is never given so it can stand for none. */
+
+#define HEAP_HEADER 16 // keeps blocks aligned to 16 bytes
+#define HEAP_LIVE 0x4C495645
+#define HEAP_FREE 0x46524545
+
+struct heap_header {
+  uint32_t size_class;
+  uint32_t state;
+};
+
+static struct heap_header *heap_header_at(struct heap *heap, size_t address) {
+  return (struct heap_header *)(heap->base + address - HEAP_HEADER);
+}
+
+// Whether address may be a RESV block, links and headers are on memory the
+// code can write so they are never trusted
+static int heap_is_block(struct heap *heap, size_t address) {
+  return address % HEAP_HEADER == 0 && address >= 2 * HEAP_HEADER &&
+         address < heap->top;
+}
+
+static size_t heap_block_size(int size_class) {
+  return HEAP_HEADER + ((size_t)HEAP_MIN_BLOCK << size_class);
+}
+
+// Whether the bytes are all on reserved memory, either the RESV blocks or
+// the ARENA ones
+int heap_is_reserved(struct heap *heap, size_t address, size_t size) {
+  if (address < heap->top) {
+    return size <= heap->top - address;
+  }
+  return address >= heap->arena && address <= heap->size &&
+         size <= heap->size - address;
+}
+
+retcode heap_init(struct heap *heap, size_t size) {
+  assert(heap != NULL);
+  size = (size + HEAP_HEADER - 1) / HEAP_HEADER * HEAP_HEADER;
+  heap->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (heap->base == MAP_FAILED) {
+    memset(heap, 0, sizeof(struct heap));
+    return ERROR;
+  }
+
+  heap->size = size;
+  heap_reset(heap, 1);
+  return SUCCESS;
+}
+
+void heap_free(struct heap *heap) {
+  if (heap->base != NULL) {
+    munmap(heap->base, heap->size);
+    heap->base = NULL;
+  }
+}
+
+void heap_reset(struct heap *heap, int all) {
+  heap->arena = heap->size;
+  if (all) {
+    heap->top = HEAP_HEADER;
+    memset(heap->free, 0, sizeof(heap->free));
+  }
+}
+
+// Resets all and gives the pages touched back, so the segment reads zeros
+// again as it did after heap_init
+void heap_clear(struct heap *heap) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t top = (heap->top + page - 1) / page * page;
+  size_t arena = heap->arena / page * page;
+  if (heap->top > HEAP_HEADER) {
+    madvise(heap->base, top < heap->size ? top : heap->size, MADV_DONTNEED);
+  }
+  if (heap->arena < heap->size) {
+    madvise(heap->base + arena, heap->size - arena, MADV_DONTNEED);
+  }
+  heap_reset(heap, 1);
+}
+
+// Carves the free space into blocks of the class, a pool of them for the
+// small ones
+static retcode heap_grow(struct heap *heap, int size_class) {
+  size_t block = heap_block_size(size_class);
+  size_t count = block <= HEAP_POOL_SIZE / 4 ? HEAP_POOL_SIZE / block : 1;
+  if (heap->arena - heap->top < block) {
+    return ERROR;
+  }
+  if (heap->arena - heap->top < block * count) {
+    count = 1;
+  }
+
+  // blocks are linked in address order so the pool is handed out in order
+  for (size_t i = count; i > 0; i--) {
+    size_t address = heap->top + (i - 1) * block + HEAP_HEADER;
+    struct heap_header *header = heap_header_at(heap, address);
+    header->size_class = size_class;
+    header->state = HEAP_FREE;
+    memcpy(heap->base + address, &heap->free[size_class], sizeof(size_t));
+    heap->free[size_class] = address;
+  }
+
+  heap->top += block * count;
+  return SUCCESS;
+}
+
+retcode heap_alloc(struct heap *heap, size_t size, size_t *address) {
+  int size_class = 0;
+  while (size_class < HEAP_CLASSES &&
+         ((size_t)HEAP_MIN_BLOCK << size_class) < size) {
+    size_class++;
+  }
+
+  if (size_class == HEAP_CLASSES ||
+      (heap->free[size_class] == 0 && heap_grow(heap, size_class) == ERROR)) {
+    return ERROR;
+  }
+
+  *address = heap->free[size_class];
+  if (!heap_is_block(heap, *address)) {
+    return ERROR;
+  }
+  memcpy(&heap->free[size_class], heap->base + *address, sizeof(size_t));
+  heap_header_at(heap, *address)->state = HEAP_LIVE;
+  return SUCCESS;
+}
+
+retcode heap_release(struct heap *heap, size_t address) {
+  if (!heap_is_block(heap, address)) {
+    return ERROR;
+  }
+
+  struct heap_header *header = heap_header_at(heap, address);
+  if (header->state != HEAP_LIVE || header->size_class >= HEAP_CLASSES) {
+    return ERROR;
+  }
+
+  header->state = HEAP_FREE;
+  memcpy(heap->base + address, &heap->free[header->size_class],
+         sizeof(size_t));
+  heap->free[header->size_class] = address;
+  return SUCCESS;
+}
+
+retcode heap_scratch(struct heap *heap, size_t size, size_t *address) {
+  if (size > heap->arena - heap->top) {
+    return ERROR;
+  }
+
+  size = size == 0 ? HEAP_HEADER
+                   : (size + HEAP_HEADER - 1) / HEAP_HEADER * HEAP_HEADER;
+  if (size > heap->arena - heap->top) {
+    return ERROR;
+  }
+
+  heap->arena -= size;
+  *address = heap->arena;
+  return SUCCESS;
+}
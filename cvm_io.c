@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* File I/O of the vm over an io_uring ring, made on the first I/O opcode.
+ * A request goes on the submission queue and the fiber that made it waits
+ * (fiber_park) while the rest go on, so only when every fiber waits are the
+ * requests queued by all of them given to the kernel, on the same call that
+ * waits for the first ones to complete. Each completion pushes the result on
+ * the stack of its fiber and puts it back on the run queue. A vm without
+ * fibers is fiber 0 on its own, and waits on the ring for each request. When
+ * the kernel has no io_uring the requests are plain system calls. */
+
+#define IO_ENTRIES 256
+
+struct io {
+  int ring; // io_uring, or -1 to run plain system calls
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring; // the same mapping as sq_ring on newer kernels
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned cq_entries;
+  unsigned queued;   // on the submission queue, not given to the kernel yet
+  unsigned inflight; // queued or given, not completed
+};
+
+static void io_unmap(struct io *io) {
+  if (io->sqes != NULL) {
+    munmap(io->sqes, io->sqes_size);
+  }
+  if (io->cq_ring != NULL && io->cq_ring != io->sq_ring) {
+    munmap(io->cq_ring, io->cq_ring_size);
+  }
+  if (io->sq_ring != NULL) {
+    munmap(io->sq_ring, io->sq_ring_size);
+  }
+  close(io->ring);
+  io->ring = -1;
+}
+
+static void io_setup(struct io *io) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  io->ring = syscall(__NR_io_uring_setup, IO_ENTRIES, &params);
+  if (io->ring < 0) {
+    io->ring = -1;
+    return;
+  }
+
+  // reads and writes at the position of the file need it, as do pipes
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    io_unmap(io);
+    return;
+  }
+
+  io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  io->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (io->cq_ring_size > io->sq_ring_size) {
+      io->sq_ring_size = io->cq_ring_size;
+    }
+    io->cq_ring_size = io->sq_ring_size;
+  }
+
+  io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQ_RING);
+  if (io->sq_ring == MAP_FAILED) {
+    io->sq_ring = NULL;
+    io_unmap(io);
+    return;
+  }
+
+  io->cq_ring = io->sq_ring;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_CQ_RING);
+    if (io->cq_ring == MAP_FAILED) {
+      io->cq_ring = NULL;
+      io_unmap(io);
+      return;
+    }
+  }
+
+  io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQES);
+  if (io->sqes == MAP_FAILED) {
+    io->sqes = NULL;
+    io_unmap(io);
+    return;
+  }
+
+  uint8_t *sq = io->sq_ring;
+  uint8_t *cq = io->cq_ring;
+  io->sq_head = (unsigned *)(sq + params.sq_off.head);
+  io->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  io->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  io->sq_array = (unsigned *)(sq + params.sq_off.array);
+  io->cq_head = (unsigned *)(cq + params.cq_off.head);
+  io->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  io->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  io->sq_entries = params.sq_entries;
+  io->cq_entries = params.cq_entries;
+}
+
+static retcode io_init(struct vm *vm) {
+  struct io *io = calloc(1, sizeof(struct io));
+  if (io == NULL) {
+    return ERROR;
+  }
+
+  io_setup(io);
+  vm->io = io;
+  return SUCCESS;
+}
+
+// Gives the queued requests to the kernel, waiting for some to complete
+static retcode io_enter(struct vm *vm, unsigned wait) {
+  struct io *io = vm->io;
+  for (;;) {
+    long done = syscall(__NR_io_uring_enter, io->ring, io->queued, wait,
+                        wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (done >= 0) {
+      io->queued -= done;
+      return SUCCESS;
+    }
+    if (errno != EINTR) {
+      vm_set_error(vm, 0x83, "cannot submit I/O: %s", strerror(errno));
+      return ERROR;
+    }
+  }
+}
+
+// Takes the completions of the ring, resuming their fibers when asked to
+static void io_reap(struct vm *vm, int resume) {
+  struct io *io = vm->io;
+  unsigned head = *io->cq_head;
+  unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+    union value result = {0LL};
+    result.i64 = cqe->res;
+    if (resume) {
+      fiber_resume(vm, cqe->user_data, result);
+    }
+    io->inflight--;
+  }
+  __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Result of the request run as a plain system call
+static int64_t io_sync(const struct io_args *args) {
+  ssize_t result = 0;
+  switch (args->opcode) {
+  case OPEN:
+    result = openat(AT_FDCWD, (const char *)args->buffer,
+                    args->flags | O_CLOEXEC, 0644);
+    break;
+  case READ:
+    result = read(args->fd, args->buffer, args->len);
+    break;
+  case WRITE:
+    result = write(args->fd, args->buffer, args->len);
+    break;
+  default:
+    result = close(args->fd);
+    break;
+  }
+  return result < 0 ? -errno : result;
+}
+
+static void io_prepare(struct io_uring_sqe *sqe, const struct io_args *args) {
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd = args->fd;
+  sqe->addr = (uint64_t)(uintptr_t)args->buffer;
+  sqe->len = args->len;
+  switch (args->opcode) {
+  case OPEN:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->len = 0644;
+    sqe->open_flags = args->flags | O_CLOEXEC;
+    break;
+  case READ:
+    sqe->opcode = IORING_OP_READ;
+    sqe->off = (uint64_t)-1;
+    break;
+  case WRITE:
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->off = (uint64_t)-1;
+    break;
+  default:
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->addr = 0;
+    sqe->len = 0;
+    break;
+  }
+}
+
+retcode io_request(struct vm *vm, const struct io_args *args) {
+  assert(vm != NULL);
+  assert(args != NULL);
+  if (vm->io == NULL && io_init(vm) == ERROR) {
+    vm_set_error(vm, 0x83, "cannot start I/O");
+    return ERROR;
+  }
+
+  // the operands were popped, so the result fits
+  struct io *io = vm->io;
+  if (io->ring < 0) {
+    vm->data.bot[++vm->data.top].i64 = io_sync(args);
+    return SUCCESS;
+  }
+
+  // every completion must fit on the completion queue
+  while (io->inflight >= io->cq_entries) {
+    if (io_enter(vm, 1) == ERROR) {
+      return ERROR;
+    }
+    io_reap(vm, 1);
+  }
+  if (io->queued == io->sq_entries && io_enter(vm, 0) == ERROR) {
+    return ERROR;
+  }
+
+  unsigned tail = *io->sq_tail;
+  unsigned index = tail & *io->sq_mask;
+  io_prepare(&io->sqes[index], args);
+  io->sqes[index].user_data = fiber_current(vm);
+  io->sq_array[index] = index;
+  __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  io->queued++;
+  io->inflight++;
+
+  // the result is pushed when the request completes
+  return fiber_park(vm);
+}
+
+int io_pending(struct vm *vm) {
+  return vm->io != NULL && vm->io->inflight > 0;
+}
+
+retcode io_wait(struct vm *vm) {
+  assert(io_pending(vm));
+  if (io_enter(vm, 1) == ERROR) {
+    return ERROR;
+  }
+  io_reap(vm, 1);
+  return SUCCESS;
+}
+
+void io_drain(struct vm *vm) {
+  assert(vm != NULL);
+  struct io *io = vm->io;
+  if (io == NULL) {
+    return;
+  }
+
+  // the kernel may still write on the data segment, so the fibers that made
+  // the requests are dropped but the requests are not
+  while (io->inflight > 0) {
+    if (io_enter(vm, 1) == ERROR) {
+      break;
+    }
+    io_reap(vm, 0);
+  }
+}
+
+void io_free(struct vm *vm) {
+  assert(vm != NULL);
+  if (vm->io == NULL) {
+    return;
+  }
+
+  io_drain(vm);
+  if (vm->io->ring >= 0) {
+    io_unmap(vm->io);
+  }
+  free(vm->io);
+  vm->io = NULL;
+}
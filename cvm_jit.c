@@ -0,0 +1,1136 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Template compiler from pre-decoded code to x86-64. Every basic block gets
+ * a native entry that runs it with the data stack in registers:
+ *
+ *   rbx  struct vm *
+ *   r12  data.bot
+ *   r13  data.top
+ *   r14  value on top of the stack, while it is cached
+ *
+ * Blocks jump to each other directly and only go back to the runtime loop
+ * on RET, on instructions they do not translate and whenever something may
+ * fail. Failures exit before touching any state so the step interpreter runs
+ * the same instruction again and reports the error as usual. */
+
+// Status returned by native code, vm->code_offset is always updated
+#define JIT_CONTINUE 0 // keep running from code_offset
+#define JIT_STEP 1     // let the step interpreter run code_offset
+
+#define JIT_REACHED 0x01
+#define JIT_LEADER 0x02
+#define JIT_EXCLUDED 0x04 // written by STORE, left to the interpreters
+
+// Registers, by their x86-64 encoding
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define R12 12
+#define R13 13
+#define R14 14
+
+// Condition codes for the second byte of jcc rel32
+#define CC_JMP 0x00
+#define CC_JZ 0x84
+#define CC_JNZ 0x85
+#define CC_JS 0x88
+#define CC_JA 0x87
+#define CC_JL 0x8C
+#define CC_JGE 0x8D
+#define CC_JG 0x8F
+
+#define FIELD(member) offsetof(struct vm, member)
+#define DATA_FIELD(member) (FIELD(data) + offsetof(struct stack, member))
+#define CALL_FIELD(member) (FIELD(call) + offsetof(struct stack, member))
+
+typedef int (*jit_entry)(struct vm *vm);
+
+struct jit_chunk {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  struct jit_chunk *next;
+};
+
+// Bytes of code a compiled STORE writes
+struct jit_store {
+  size_t from;
+  size_t to;
+};
+
+struct jit {
+  jit_entry *entries; // native entry of each block leader, NULL otherwise
+  struct jit_chunk *chunks;
+  struct jit_store *stores; // of every unit, decoded again when leaving
+  size_t stores_len;
+  size_t stores_cap;
+};
+
+struct jit_buf {
+  uint8_t *bytes;
+  size_t len;
+  size_t cap;
+  int failed;
+};
+
+// A rel32 that goes to a block, or to an exit stub when it is not compiled
+struct jit_patch {
+  size_t at;
+  size_t offset;
+  int status;
+  int dirty; // r14 has to be written back before exiting
+  int block;
+};
+
+struct jit_compiler {
+  struct vm *vm;
+  struct jit_buf buf;
+  uint8_t *flags;
+  size_t *body_at; // position of the code after the entry of each block
+  size_t *entry_at;
+  struct jit_patch *patches;
+  size_t patches_len;
+  size_t patches_cap;
+  int cached; // r14 holds the top of the stack
+  int dirty;  // and its slot on the stack is out of date
+};
+
+static void emit(struct jit_buf *b, const uint8_t *bytes, size_t len) {
+  if (b->failed) {
+    return;
+  }
+
+  if (b->len + len > b->cap) {
+    size_t cap = b->cap != 0 ? b->cap * 2 : DEFAULT_EXT_PAGE_SIZE;
+    while (cap < b->len + len) {
+      cap *= 2;
+    }
+
+    uint8_t *bytes = realloc(b->bytes, cap);
+    if (bytes == NULL) {
+      b->failed = 1;
+      return;
+    }
+    b->bytes = bytes;
+    b->cap = cap;
+  }
+
+  memcpy(b->bytes + b->len, bytes, len);
+  b->len += len;
+}
+
+#define EMIT(b, ...)                                                           \
+  do {                                                                         \
+    const uint8_t emit_bytes[] = {__VA_ARGS__};                                \
+    emit(b, emit_bytes, sizeof(emit_bytes));                                   \
+  } while (0)
+
+static void emit_u32(struct jit_buf *b, uint32_t v) {
+  EMIT(b, v, v >> 8, v >> 16, v >> 24);
+}
+
+static void emit_u64(struct jit_buf *b, uint64_t v) {
+  emit_u32(b, v);
+  emit_u32(b, v >> 32);
+}
+
+static void patch_rel32(struct jit_buf *b, size_t at, size_t to) {
+  if (b->failed) {
+    return;
+  }
+
+  uint32_t rel = (uint32_t)(to - (at + 4));
+  b->bytes[at] = rel;
+  b->bytes[at + 1] = rel >> 8;
+  b->bytes[at + 2] = rel >> 16;
+  b->bytes[at + 3] = rel >> 24;
+}
+
+// <opcode> reg, [r12 + r13 * 8 + disp * 8]
+static void emit_slot(struct jit_buf *b, uint8_t opcode, int reg, int disp) {
+  EMIT(b, 0x4B | ((reg & 8) >> 1), opcode, 0x44 | ((reg & 7) << 3), 0xEC,
+       (uint8_t)(disp * 8));
+}
+
+// <opcode> reg, [rbx + field]
+static void emit_field(struct jit_buf *b, uint8_t opcode, int reg,
+                       size_t field) {
+  EMIT(b, 0x48 | ((reg & 8) >> 1), opcode, 0x83 | ((reg & 7) << 3));
+  emit_u32(b, field);
+}
+
+// mov qword [rbx + field], imm32
+static void emit_field_imm(struct jit_buf *b, size_t field, uint32_t imm) {
+  emit_field(b, 0xC7, RAX, field);
+  emit_u32(b, imm);
+}
+
+static void emit_jump(struct jit_compiler *c, uint8_t cc, int block,
+                      size_t offset, int status) {
+  if (cc == CC_JMP) {
+    EMIT(&c->buf, 0xE9);
+  } else {
+    EMIT(&c->buf, 0x0F, cc);
+  }
+
+  if (c->patches_len == c->patches_cap) {
+    size_t cap = c->patches_cap != 0 ? c->patches_cap * 2 : 64;
+    struct jit_patch *patches =
+        realloc(c->patches, sizeof(struct jit_patch) * cap);
+    if (patches == NULL) {
+      c->buf.failed = 1;
+      return;
+    }
+    c->patches = patches;
+    c->patches_cap = cap;
+  }
+
+  struct jit_patch *patch = &c->patches[c->patches_len++];
+  patch->at = c->buf.len;
+  patch->offset = offset;
+  patch->status = status;
+  patch->dirty = c->cached && c->dirty;
+  patch->block = block;
+  emit_u32(&c->buf, 0);
+}
+
+// Leave the runtime to run the instruction at offset with all checks
+static void emit_step_exit(struct jit_compiler *c, uint8_t cc, size_t offset) {
+  emit_jump(c, cc, 0, offset, JIT_STEP);
+}
+
+static void emit_block_jump(struct jit_compiler *c, uint8_t cc, size_t offset) {
+  emit_jump(c, cc, 1, offset, JIT_CONTINUE);
+}
+
+static void emit_flush(struct jit_compiler *c) {
+  if (c->cached && c->dirty) {
+    emit_slot(&c->buf, 0x89, R14, 0); // mov [top], r14
+    c->dirty = 0;
+  }
+}
+
+static void emit_ensure(struct jit_compiler *c) {
+  if (!c->cached) {
+    emit_slot(&c->buf, 0x8B, R14, 0); // mov r14, [top]
+    c->cached = 1;
+    c->dirty = 0;
+  }
+}
+
+// Sign or zero extends rax or rcx to 64 bits as the mode reads it
+static void emit_extend(struct jit_buf *b, int reg, uint8_t mode) {
+  uint8_t modrm = reg == RCX ? 0xC9 : 0xC0;
+  switch (mode) {
+  case 0x00:
+    EMIT(b, 0x0F, 0xB6, modrm); // movzx eax, al
+    break;
+  case 0x01:
+    EMIT(b, 0x0F, 0xB7, modrm); // movzx eax, ax
+    break;
+  case 0x02:
+    EMIT(b, 0x89, modrm); // mov eax, eax
+    break;
+  case 0x04:
+    EMIT(b, 0x48, 0x0F, 0xBE, modrm); // movsx rax, al
+    break;
+  case 0x05:
+    EMIT(b, 0x48, 0x0F, 0xBF, modrm); // movsx rax, ax
+    break;
+  case 0x06:
+    EMIT(b, 0x48, 0x63, modrm); // movsxd rax, eax
+    break;
+  default:
+    break;
+  }
+}
+
+// Drops what is above the width of the mode, as writing to the union does
+static void emit_truncate(struct jit_buf *b, uint8_t mode) {
+  emit_extend(b, RAX, mode & 0x03);
+}
+
+static void emit_to_xmm(struct jit_buf *b, uint8_t mode) {
+  if (mode == 0x08) {
+    EMIT(b, 0x66, 0x0F, 0x6E, 0xC0); // movd xmm0, eax
+    EMIT(b, 0x66, 0x0F, 0x6E, 0xC9); // movd xmm1, ecx
+  } else {
+    EMIT(b, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+    EMIT(b, 0x66, 0x48, 0x0F, 0x6E, 0xC9); // movq xmm1, rcx
+  }
+}
+
+static void emit_from_xmm(struct jit_buf *b, uint8_t mode) {
+  if (mode == 0x08) {
+    EMIT(b, 0x66, 0x0F, 0x7E, 0xC0); // movd eax, xmm0
+  } else {
+    EMIT(b, 0x66, 0x48, 0x0F, 0x7E, 0xC0); // movq rax, xmm0
+  }
+}
+
+// rax = value_op(rax, rcx) for arithmetic and bitwise opcodes
+static void emit_arith(struct jit_buf *b, uint8_t opcode, uint8_t mode) {
+  if (mode >= 0x08) {
+    uint8_t sse = opcode == ADD ? 0x58 : opcode == SUB ? 0x5C
+                                     : opcode == MUL   ? 0x59
+                                                       : 0x5E;
+    emit_to_xmm(b, mode);
+    EMIT(b, mode == 0x08 ? 0xF3 : 0xF2, 0x0F, sse, 0xC1); // <op>ss/sd
+    emit_from_xmm(b, mode);
+    return;
+  }
+
+  switch (opcode) {
+  case ADD:
+    EMIT(b, 0x48, 0x01, 0xC8); // add rax, rcx
+    break;
+  case SUB:
+    EMIT(b, 0x48, 0x29, 0xC8); // sub rax, rcx
+    break;
+  case MUL:
+    EMIT(b, 0x48, 0x0F, 0xAF, 0xC1); // imul rax, rcx
+    break;
+  case AND:
+    EMIT(b, 0x48, 0x21, 0xC8); // and rax, rcx
+    break;
+  case OR:
+    EMIT(b, 0x48, 0x09, 0xC8); // or rax, rcx
+    break;
+  case XOR:
+    EMIT(b, 0x48, 0x31, 0xC8); // xor rax, rcx
+    break;
+  case DIV:
+  case MOD:
+    emit_extend(b, RAX, mode);
+    emit_extend(b, RCX, mode);
+    if (mode >= 0x04) {
+      EMIT(b, 0x48, 0x99);       // cqo
+      EMIT(b, 0x48, 0xF7, 0xF9); // idiv rcx
+    } else {
+      EMIT(b, 0x31, 0xD2);       // xor edx, edx
+      EMIT(b, 0x48, 0xF7, 0xF1); // div rcx
+    }
+    if (opcode == MOD) {
+      EMIT(b, 0x48, 0x89, 0xD0); // mov rax, rdx
+    }
+    break;
+  default:
+    assert(0 && "unreachable code");
+    break;
+  }
+
+  emit_truncate(b, mode);
+}
+
+// rax = value_op(rax, rcx) for comparisons, 1 or 0 in the type of the mode
+static void emit_compare(struct jit_buf *b, uint8_t opcode, uint8_t mode) {
+  if (mode >= 0x08) {
+    emit_to_xmm(b, mode);
+
+    // unordered operands set ZF, PF and CF, which must make everything but
+    // NEQ false
+    int swap = opcode == LT || opcode == LE;
+    if (mode == 0x09) {
+      EMIT(b, 0x66);
+    }
+    EMIT(b, 0x0F, 0x2E, swap ? 0xC8 : 0xC1); // ucomis xmm0/1, xmm1/0
+
+    switch (opcode) {
+    case NEQ:
+      EMIT(b, 0x0F, 0x95, 0xC0); // setne al
+      EMIT(b, 0x0F, 0x9A, 0xC1); // setp cl
+      EMIT(b, 0x08, 0xC8);       // or al, cl
+      break;
+    case EQ:
+      EMIT(b, 0x0F, 0x94, 0xC0); // sete al
+      EMIT(b, 0x0F, 0x9B, 0xC1); // setnp cl
+      EMIT(b, 0x20, 0xC8);       // and al, cl
+      break;
+    case LT:
+    case GT:
+      EMIT(b, 0x0F, 0x97, 0xC0); // seta al
+      break;
+    default:
+      EMIT(b, 0x0F, 0x93, 0xC0); // setae al
+      break;
+    }
+
+    EMIT(b, 0x0F, 0xB6, 0xC0);                             // movzx eax, al
+    EMIT(b, mode == 0x08 ? 0xF3 : 0xF2, 0x0F, 0x2A, 0xC0); // cvtsi2ss/sd
+    emit_from_xmm(b, mode);
+    return;
+  }
+
+  int sign = mode >= 0x04;
+  uint8_t cc = 0;
+  switch (opcode) {
+  case NEQ:
+    cc = 0x95; // setne
+    break;
+  case EQ:
+    cc = 0x94; // sete
+    break;
+  case LT:
+    cc = sign ? 0x9C : 0x92; // setl/setb
+    break;
+  case LE:
+    cc = sign ? 0x9E : 0x96; // setle/setbe
+    break;
+  case GT:
+    cc = sign ? 0x9F : 0x97; // setg/seta
+    break;
+  default:
+    cc = sign ? 0x9D : 0x93; // setge/setae
+    break;
+  }
+
+  emit_extend(b, RAX, mode);
+  emit_extend(b, RCX, mode);
+  EMIT(b, 0x48, 0x39, 0xC8); // cmp rax, rcx
+  EMIT(b, 0x0F, cc, 0xC0);   // set<cc> al
+  EMIT(b, 0x0F, 0xB6, 0xC0); // movzx eax, al
+}
+
+static int jit_supports(struct vm *vm, struct insn *insn) {
+  if (insn->op == OP_STEP) {
+    return 0;
+  }
+
+  switch ((enum opcode)insn->opcode) {
+  case ADD:
+  case SUB:
+  case MUL:
+  case DIV:
+  case NEQ:
+  case EQ:
+  case LT:
+  case LE:
+  case GT:
+  case GE:
+    return insn->mode <= 0x09;
+  case MOD:
+  case AND:
+  case OR:
+  case XOR:
+  case NOT:
+    return insn->mode <= 0x07;
+  case JNZ:
+  case JZ:
+  case JMP:
+    return insn->target != NULL;
+  case CALL:
+    return insn->target != NULL && insn->next <= INT32_MAX;
+  case LOAD:
+  case STORE:
+    return insn->imm.size <= vm->code_size &&
+           vm->code_size - insn->imm.size >= insn_width(insn->mode);
+  case SETHDLR:
+    return insn->imm.size <= INT32_MAX;
+  case PEEK:
+  case POKE:
+  case FFI_CALL:
+  case NATIVE:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+static int jit_compilable(struct jit_compiler *c, size_t slot) {
+  struct vm *vm = c->vm;
+  return slot < vm->insns_count && (c->flags[slot] & JIT_REACHED) &&
+         !(c->flags[slot] & JIT_EXCLUDED) &&
+         jit_supports(vm, &vm->insns[slot]);
+}
+
+static void jit_mark(struct jit_compiler *c, size_t offset, uint8_t flags,
+                     size_t *work, size_t *work_len) {
+  struct vm *vm = c->vm;
+  if (offset % 4 != 0 || offset / 4 >= vm->insns_count) {
+    return;
+  }
+
+  // code compiled before is entered through the runtime loop
+  size_t slot = offset / 4;
+  if (vm->jit->entries[slot] != NULL) {
+    return;
+  }
+
+  c->flags[slot] |= flags & JIT_LEADER;
+  if (!(c->flags[slot] & JIT_REACHED)) {
+    c->flags[slot] |= JIT_REACHED;
+    work[(*work_len)++] = slot;
+  }
+}
+
+// Any word decoded as a STORE may write on code, which is left to the
+// interpreters no matter which unit would compile it
+static void jit_exclude_stores(struct jit_compiler *c) {
+  struct vm *vm = c->vm;
+  for (size_t slot = 0; slot < vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    if (insn->op == OP_STEP || insn->opcode != STORE) {
+      continue;
+    }
+
+    // the two words before the written ones may have feeds on them
+    size_t width = insn_width(insn->mode);
+    size_t first = insn->imm.size / 4 >= 2 ? insn->imm.size / 4 - 2 : 0;
+    size_t last = (insn->imm.size + width - 1) / 4;
+    for (size_t word = first; word <= last && word < vm->insns_count;
+         word++) {
+      c->flags[word] |= JIT_EXCLUDED;
+    }
+  }
+}
+
+// Finds the code reachable from the roots and where its blocks start
+static void jit_scan(struct jit_compiler *c, const size_t *roots,
+                     size_t roots_len) {
+  struct vm *vm = c->vm;
+  size_t *work = malloc(sizeof(size_t) * (vm->insns_count + 1));
+  size_t work_len = 0;
+  if (work == NULL) {
+    c->buf.failed = 1;
+    return;
+  }
+
+  for (size_t i = 0; i < roots_len; i++) {
+    jit_mark(c, roots[i], JIT_LEADER, work, &work_len);
+  }
+
+  while (work_len > 0) {
+    struct insn *insn = &vm->insns[work[--work_len]];
+    size_t next = insn_next(vm, insn);
+    uint8_t after = jit_supports(vm, insn) ? 0 : JIT_LEADER;
+    if (next == 0) {
+      continue;
+    }
+
+    if (insn->op == OP_STEP) {
+      if (insn->opcode == SPAWN && insn->target != NULL) {
+        jit_mark(c, insn->target->offset, JIT_LEADER, work, &work_len);
+      }
+      if (insn->opcode != HALT && insn->opcode != SETERR) {
+        jit_mark(c, next, JIT_LEADER, work, &work_len);
+      }
+      continue;
+    }
+
+    switch ((enum opcode)insn->opcode) {
+    case RET:
+      break;
+    case JMP:
+      jit_mark(c, insn->imm.size, JIT_LEADER, work, &work_len);
+      break;
+    case JNZ:
+    case JZ:
+    case CALL:
+      jit_mark(c, insn->imm.size, JIT_LEADER, work, &work_len);
+      jit_mark(c, next, JIT_LEADER, work, &work_len);
+      break;
+    case SETHDLR:
+      jit_mark(c, insn->imm.size, JIT_LEADER, work, &work_len);
+      jit_mark(c, next, after, work, &work_len);
+      break;
+    default:
+      jit_mark(c, next, after, work, &work_len);
+      break;
+    }
+  }
+
+  free(work);
+}
+
+// Data stack depth a block needs on entry and how much it grows
+static void jit_block_effect(struct jit_compiler *c, size_t slot,
+                             int64_t *need, int64_t *grow) {
+  struct vm *vm = c->vm;
+  int64_t depth = 0;
+  *need = 0;
+  *grow = 0;
+  for (;;) {
+    struct insn *insn = &vm->insns[slot];
+    int64_t pops = 0;
+    int64_t pushes = 0;
+    switch ((enum opcode)insn->opcode) {
+    case PUSH:
+    case LOAD:
+      pushes = 1;
+      break;
+    case POP:
+    case STORE:
+      pops = 1;
+      break;
+    case SWAP:
+      pops = pushes = 2;
+      break;
+    case ROT3:
+      pops = pushes = 3;
+      break;
+    case NOT:
+    case JNZ:
+    case JZ:
+      pops = pushes = 1;
+      break;
+    default:
+      if (insn->opcode >= ADD && insn->opcode <= GE) {
+        pops = 2;
+        pushes = 1;
+      }
+      break;
+    }
+
+    if (pops - depth > *need) {
+      *need = pops - depth;
+    }
+    depth += pushes - pops;
+    if (depth > *grow) {
+      *grow = depth;
+    }
+
+    size_t next = insn->next / 4;
+    if (insn->opcode == JNZ || insn->opcode == JZ || insn->opcode == JMP ||
+        insn->opcode == CALL || insn->opcode == RET ||
+        (c->flags[next] & JIT_LEADER) || !jit_compilable(c, next)) {
+      return;
+    }
+    slot = next;
+  }
+}
+
+// Translates one instruction, returns 1 when it ends the block
+// Native stores do not decode what they write, the records of the tiered
+// interpreter are decoded again when native code leaves
+static void jit_note_store(struct jit_compiler *c, size_t from, size_t to) {
+  struct jit *jit = c->vm->jit;
+  for (size_t i = 0; i < jit->stores_len; i++) {
+    if (jit->stores[i].from == from && jit->stores[i].to == to) {
+      return;
+    }
+  }
+
+  if (jit->stores_len == jit->stores_cap) {
+    size_t cap = jit->stores_cap > 0 ? jit->stores_cap * 2 : 8;
+    struct jit_store *stores =
+        realloc(jit->stores, sizeof(struct jit_store) * cap);
+    if (stores == NULL) {
+      c->buf.failed = 1;
+      return;
+    }
+    jit->stores = stores;
+    jit->stores_cap = cap;
+  }
+  jit->stores[jit->stores_len].from = from;
+  jit->stores[jit->stores_len].to = to;
+  jit->stores_len++;
+}
+
+static int jit_insn(struct jit_compiler *c, struct insn *insn) {
+  struct jit_buf *b = &c->buf;
+  struct vm *vm = c->vm;
+  uint8_t opcode = insn->opcode;
+  uint8_t mode = insn->mode;
+
+  if (opcode >= ADD && opcode <= GE) {
+    emit_ensure(c);
+    if (opcode == DIV || opcode == MOD) {
+      EMIT(b, 0x4D, 0x85, 0xF6); // test r14, r14
+      emit_step_exit(c, CC_JZ, insn->offset);
+    }
+
+    emit_slot(b, 0x8B, RAX, -1); // mov rax, [top - 1]
+    EMIT(b, 0x4C, 0x89, 0xF1);   // mov rcx, r14
+    EMIT(b, 0x49, 0xFF, 0xCD);   // dec r13
+    if (opcode >= NEQ) {
+      emit_compare(b, opcode, mode);
+    } else {
+      emit_arith(b, opcode, mode);
+    }
+    EMIT(b, 0x49, 0x89, 0xC6); // mov r14, rax
+    c->dirty = 1;
+    return 0;
+  }
+
+  switch ((enum opcode)opcode) {
+  case NOP:
+    break;
+  case PUSH:
+    emit_flush(c);
+    EMIT(b, 0x49, 0xFF, 0xC5); // inc r13
+    if (insn->imm.u64 <= INT32_MAX) {
+      EMIT(b, 0x49, 0xC7, 0xC6); // mov r14, imm32
+      emit_u32(b, insn->imm.u64);
+    } else {
+      EMIT(b, 0x49, 0xBE); // mov r14, imm64
+      emit_u64(b, insn->imm.u64);
+    }
+    c->cached = 1;
+    c->dirty = 1;
+    break;
+  case POP:
+    EMIT(b, 0x49, 0xFF, 0xCD); // dec r13
+    c->cached = 0;
+    c->dirty = 0;
+    break;
+  case SWAP:
+    emit_ensure(c);
+    emit_slot(b, 0x8B, RAX, -1); // mov rax, [top - 1]
+    emit_slot(b, 0x89, R14, -1); // mov [top - 1], r14
+    EMIT(b, 0x49, 0x89, 0xC6);   // mov r14, rax
+    c->dirty = 1;
+    break;
+  case ROT3:
+    emit_ensure(c);
+    emit_slot(b, 0x8B, RAX, -1); // mov rax, [top - 1]
+    emit_slot(b, 0x8B, RCX, -2); // mov rcx, [top - 2]
+    emit_slot(b, 0x89, R14, -2); // mov [top - 2], r14
+    emit_slot(b, 0x89, RCX, -1); // mov [top - 1], rcx
+    EMIT(b, 0x49, 0x89, 0xC6);   // mov r14, rax
+    c->dirty = 1;
+    break;
+  case NOT:
+    emit_ensure(c);
+    EMIT(b, 0x4C, 0x89, 0xF0); // mov rax, r14
+    EMIT(b, 0x48, 0xF7, 0xD0); // not rax
+    emit_truncate(b, mode);
+    EMIT(b, 0x49, 0x89, 0xC6); // mov r14, rax
+    c->dirty = 1;
+    break;
+  case JNZ:
+  case JZ:
+    emit_ensure(c);
+    emit_flush(c);
+    EMIT(b, 0x4D, 0x85, 0xF6); // test r14, r14
+    emit_block_jump(c, opcode == JZ ? CC_JZ : CC_JNZ, insn->imm.size);
+    emit_block_jump(c, CC_JMP, insn->next);
+    return 1;
+  case JMP:
+    emit_flush(c);
+    emit_block_jump(c, CC_JMP, insn->imm.size);
+    return 1;
+  case CALL:
+    emit_flush(c);
+    emit_field(b, 0x8B, RAX, CALL_FIELD(top)); // mov rax, [call.top]
+    emit_field(b, 0x3B, RAX, CALL_FIELD(cap)); // cmp rax, [call.cap]
+    emit_step_exit(c, CC_JGE, insn->offset);
+    EMIT(b, 0x48, 0xFF, 0xC0);                 // inc rax
+    emit_field(b, 0x89, RAX, CALL_FIELD(top)); // mov [call.top], rax
+    emit_field(b, 0x8B, RCX, CALL_FIELD(bot)); // mov rcx, [call.bot]
+    EMIT(b, 0x48, 0xC7, 0x04, 0xC1);           // mov [rcx + rax * 8], imm32
+    emit_u32(b, insn->next);
+    emit_block_jump(c, CC_JMP, insn->imm.size);
+    return 1;
+  case RET:
+    emit_flush(c);
+    emit_field(b, 0x8B, RAX, CALL_FIELD(top)); // mov rax, [call.top]
+    EMIT(b, 0x48, 0x85, 0xC0);                 // test rax, rax
+    emit_step_exit(c, CC_JS, insn->offset);
+    emit_field(b, 0x8B, RCX, CALL_FIELD(bot)); // mov rcx, [call.bot]
+    EMIT(b, 0x48, 0x8B, 0x14, 0xC1);           // mov rdx, [rcx + rax * 8]
+    EMIT(b, 0x48, 0x81, 0xFA);                 // cmp rdx, imm32
+    emit_u32(b, vm->code_size - 4);
+    emit_step_exit(c, CC_JA, insn->offset);
+    EMIT(b, 0x48, 0xFF, 0xC8);                    // dec rax
+    emit_field(b, 0x89, RAX, CALL_FIELD(top));    // mov [call.top], rax
+    emit_field(b, 0x89, RDX, FIELD(code_offset)); // mov [code_offset], rdx
+    EMIT(b, 0x31, 0xC0);                          // xor eax, eax
+    EMIT(b, 0xE9);                                // jmp epilogue
+    emit_u32(b, 0);
+    patch_rel32(b, b->len - 4, 0);
+    return 1;
+  case LOAD:
+    emit_flush(c);
+    EMIT(b, 0x49, 0xFF, 0xC5); // inc r13
+    EMIT(b, 0x48, 0xB8);       // mov rax, imm64
+    emit_u64(b, (uint64_t)(uintptr_t)(vm->code + insn->imm.size));
+    switch (insn_width(mode)) {
+    case 1:
+      EMIT(b, 0x44, 0x0F, 0xB6, 0x30); // movzx r14d, byte [rax]
+      break;
+    case 2:
+      EMIT(b, 0x44, 0x0F, 0xB7, 0x30); // movzx r14d, word [rax]
+      break;
+    case 4:
+      EMIT(b, 0x44, 0x8B, 0x30); // mov r14d, [rax]
+      break;
+    default:
+      EMIT(b, 0x4C, 0x8B, 0x30); // mov r14, [rax]
+      break;
+    }
+    c->cached = 1;
+    c->dirty = 1;
+    break;
+  case STORE:
+    jit_note_store(c, insn->imm.size, insn->imm.size + insn_width(mode));
+    emit_ensure(c);
+    EMIT(b, 0x48, 0xB8); // mov rax, imm64
+    emit_u64(b, (uint64_t)(uintptr_t)(vm->code + insn->imm.size));
+    switch (insn_width(mode)) {
+    case 1:
+      EMIT(b, 0x44, 0x88, 0x30); // mov [rax], r14b
+      break;
+    case 2:
+      EMIT(b, 0x66, 0x44, 0x89, 0x30); // mov [rax], r14w
+      break;
+    case 4:
+      EMIT(b, 0x44, 0x89, 0x30); // mov [rax], r14d
+      break;
+    default:
+      EMIT(b, 0x4C, 0x89, 0x30); // mov [rax], r14
+      break;
+    }
+    EMIT(b, 0x49, 0xFF, 0xCD); // dec r13
+    c->cached = 0;
+    c->dirty = 0;
+    break;
+  case SETHDLR:
+    emit_field_imm(b, FIELD(error_handler), insn->imm.size);
+    break;
+  default:
+    assert(0 && "unreachable code");
+    break;
+  }
+
+  return 0;
+}
+
+static void jit_block(struct jit_compiler *c, size_t slot) {
+  struct jit_buf *b = &c->buf;
+  struct vm *vm = c->vm;
+
+  c->entry_at[slot] = b->len;
+  EMIT(b, 0x53);             // push rbx
+  EMIT(b, 0x41, 0x54);       // push r12
+  EMIT(b, 0x41, 0x55);       // push r13
+  EMIT(b, 0x41, 0x56);       // push r14
+  EMIT(b, 0x48, 0x89, 0xFB); // mov rbx, rdi
+  emit_field(b, 0x8B, R12, DATA_FIELD(bot));
+  emit_field(b, 0x8B, R13, DATA_FIELD(top));
+
+  // blocks jumping here have already written the stack back
+  c->body_at[slot] = b->len;
+  c->cached = 0;
+  c->dirty = 0;
+
+  // the stack checks of the whole block are done up front, the step
+  // interpreter runs it when they fail to report the right instruction
+  int64_t need, grow;
+  jit_block_effect(c, slot, &need, &grow);
+  if (need > 0) {
+    EMIT(b, 0x49, 0x81, 0xFD); // cmp r13, imm32
+    emit_u32(b, need - 1);
+    emit_step_exit(c, CC_JL, slot * 4);
+  }
+  if (grow > 0) {
+    EMIT(b, 0x49, 0x8D, 0x85); // lea rax, [r13 + imm32]
+    emit_u32(b, grow);
+    emit_field(b, 0x3B, RAX, DATA_FIELD(cap)); // cmp rax, [data.cap]
+    emit_step_exit(c, CC_JG, slot * 4);
+  }
+
+  for (;;) {
+    struct insn *insn = &vm->insns[slot];
+    if (jit_insn(c, insn)) {
+      return;
+    }
+
+    size_t next = insn->next / 4;
+    if ((c->flags[next] & JIT_LEADER) || !jit_compilable(c, next)) {
+      emit_flush(c);
+      emit_block_jump(c, CC_JMP, insn->next);
+      return;
+    }
+    slot = next;
+  }
+}
+
+// Exit stubs go after all blocks, jumps to compiled blocks are resolved
+static void jit_link(struct jit_compiler *c) {
+  struct jit_buf *b = &c->buf;
+  struct vm *vm = c->vm;
+  for (size_t i = 0; i < c->patches_len; i++) {
+    struct jit_patch *patch = &c->patches[i];
+    size_t slot = patch->offset / 4;
+    if (patch->block && patch->offset % 4 == 0 && slot < vm->insns_count &&
+        c->body_at[slot] != SIZE_MAX) {
+      patch_rel32(b, patch->at, c->body_at[slot]);
+      continue;
+    }
+
+    patch_rel32(b, patch->at, b->len);
+    if (patch->dirty) {
+      emit_slot(b, 0x89, R14, 0); // mov [top], r14
+    }
+    emit_field_imm(b, FIELD(code_offset), patch->offset);
+    EMIT(b, 0xB8); // mov eax, imm32
+    emit_u32(b, patch->status);
+    EMIT(b, 0xE9); // jmp epilogue
+    emit_u32(b, 0);
+    patch_rel32(b, b->len - 4, 0);
+  }
+}
+
+// Copies code to executable memory, pages are never writable and executable
+// at the same time
+static uint8_t *jit_install(struct jit *jit, const uint8_t *code, size_t len) {
+  long page = sysconf(_SC_PAGESIZE);
+  struct jit_chunk *chunk = jit->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < len) {
+    size_t size = DEFAULT_EXT_PAGE_SIZE;
+    while (size < len) {
+      size *= 2;
+    }
+    size = (size + page - 1) / page * page;
+
+    chunk = malloc(sizeof(struct jit_chunk));
+    if (chunk == NULL) {
+      return NULL;
+    }
+
+    chunk->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (chunk->base == MAP_FAILED) {
+      free(chunk);
+      return NULL;
+    }
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = jit->chunks;
+    jit->chunks = chunk;
+  } else if (mprotect(chunk->base, chunk->size, PROT_READ | PROT_WRITE) != 0) {
+    return NULL;
+  }
+
+  uint8_t *dest = chunk->base + chunk->used;
+  memcpy(dest, code, len);
+  chunk->used += (len + 15) & ~(size_t)15;
+  if (chunk->used > chunk->size) {
+    chunk->used = chunk->size;
+  }
+
+  if (mprotect(chunk->base, chunk->size, PROT_READ | PROT_EXEC) != 0) {
+    return NULL;
+  }
+  return dest;
+}
+
+void vm_jit_free(struct vm *vm) {
+  if (vm->jit == NULL) {
+    return;
+  }
+
+  struct jit_chunk *chunk = vm->jit->chunks;
+  while (chunk != NULL) {
+    struct jit_chunk *next = chunk->next;
+    munmap(chunk->base, chunk->size);
+    free(chunk);
+    chunk = next;
+  }
+
+  free(vm->jit->entries);
+  free(vm->jit->stores);
+  free(vm->jit);
+  vm->jit = NULL;
+}
+
+// Compiles the code reachable from the roots as a new unit, blocks of earlier
+// units are kept and reached through the runtime loop
+static retcode jit_compile(struct vm *vm, const size_t *roots,
+                           size_t roots_len) {
+  assert(vm != NULL);
+  assert(vm->insns != NULL);
+  if (vm->code_size < 4 || vm->code_size > INT32_MAX) {
+    fprintf(stderr, "error: code size not supported by the jit\n");
+    return ERROR;
+  }
+
+  size_t count = vm->insns_count + 1;
+  if (vm->jit == NULL) {
+    vm->jit = calloc(1, sizeof(struct jit));
+    if (vm->jit == NULL) {
+      return ERROR;
+    }
+
+    vm->jit->entries = calloc(count, sizeof(jit_entry));
+    if (vm->jit->entries == NULL) {
+      vm_jit_free(vm);
+      return ERROR;
+    }
+  }
+
+  struct jit_compiler c = {.vm = vm};
+  c.flags = calloc(count, sizeof(uint8_t));
+  c.body_at = malloc(sizeof(size_t) * count);
+  c.entry_at = malloc(sizeof(size_t) * count);
+  if (c.flags == NULL || c.body_at == NULL || c.entry_at == NULL) {
+    c.buf.failed = 1;
+  } else {
+    for (size_t slot = 0; slot < count; slot++) {
+      c.body_at[slot] = SIZE_MAX;
+      c.entry_at[slot] = SIZE_MAX;
+    }
+  }
+
+  // common epilogue, exits jump to offset 0 with the status on eax
+  emit_field(&c.buf, 0x89, R13, DATA_FIELD(top)); // mov [data.top], r13
+  EMIT(&c.buf, 0x41, 0x5E);                       // pop r14
+  EMIT(&c.buf, 0x41, 0x5D);                       // pop r13
+  EMIT(&c.buf, 0x41, 0x5C);                       // pop r12
+  EMIT(&c.buf, 0x5B);                             // pop rbx
+  EMIT(&c.buf, 0xC3);                             // ret
+
+  if (!c.buf.failed) {
+    jit_exclude_stores(&c);
+    jit_scan(&c, roots, roots_len);
+  }
+
+  size_t blocks = 0;
+  for (size_t slot = 0; slot < vm->insns_count && !c.buf.failed; slot++) {
+    if ((c.flags[slot] & JIT_LEADER) && jit_compilable(&c, slot)) {
+      jit_block(&c, slot);
+      blocks++;
+    }
+  }
+
+  jit_link(&c);
+
+  uint8_t *base = NULL;
+  if (!c.buf.failed && blocks > 0) {
+    base = jit_install(vm->jit, c.buf.bytes, c.buf.len);
+  }
+
+  if (base != NULL) {
+    for (size_t slot = 0; slot < count; slot++) {
+      if (c.entry_at[slot] != SIZE_MAX) {
+        vm->jit->entries[slot] = (jit_entry)(base + c.entry_at[slot]);
+      }
+    }
+  }
+
+  free(c.buf.bytes);
+  free(c.patches);
+  free(c.flags);
+  free(c.body_at);
+  free(c.entry_at);
+
+  if (base == NULL && (c.buf.failed || blocks > 0)) {
+    fprintf(stderr, "error: cannot compile code\n");
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+retcode vm_jit_compile(struct vm *vm) {
+  size_t roots[] = {vm->code_offset, vm->error_handler};
+  vm_jit_free(vm);
+  if (jit_compile(vm, roots, vm->error_handler != 0L ? 2 : 1) == ERROR) {
+    vm_jit_free(vm);
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+retcode vm_jit_compile_region(struct vm *vm, size_t offset) {
+  return jit_compile(vm, &offset, 1);
+}
+
+static jit_entry jit_entry_at(struct vm *vm, size_t offset) {
+  if (vm->jit == NULL || offset % 4 != 0 || offset / 4 >= vm->insns_count) {
+    return NULL;
+  }
+  return vm->jit->entries[offset / 4];
+}
+
+// Runs native code until it halts or, when leave is set, until it gets to
+// code that is not compiled. Otherwise that code is run by steps.
+static retcode jit_run(struct vm *vm, int leave) {
+  while (vm->halted == 0) {
+    jit_entry entry = jit_entry_at(vm, vm->code_offset);
+    if (entry != NULL && entry(vm) == JIT_CONTINUE) {
+      continue;
+    }
+
+    if (entry == NULL && leave) {
+      return SUCCESS;
+    }
+
+    size_t offset = vm->code_offset;
+    uint8_t opcode = offset + 4 <= vm->code_size ? vm->code[offset + 3] : 0;
+    retcode rc = vm_run_step(vm);
+    if (rc == ERROR && vm_raise(vm) == ERROR) {
+      return ERROR;
+    }
+
+    // new extern entries change code, compile everything again
+    if (opcode == FFI_MAKE_EXTERN && rc == SUCCESS) {
+      vm_jit_free(vm);
+      if (vm_predecode(vm) == ERROR) {
+        return ERROR;
+      }
+      if (!leave && vm_jit_compile(vm) == ERROR) {
+        return vm_run_threaded(vm);
+      }
+    }
+  }
+
+  return SUCCESS;
+}
+
+retcode vm_run_jit(struct vm *vm) {
+  assert(vm != NULL);
+  if (vm->jit == NULL && vm_jit_compile(vm) == ERROR) {
+    return vm_run_threaded(vm);
+  }
+  return jit_run(vm, 0);
+}
+
+retcode vm_run_tiered(struct vm *vm) {
+  assert(vm != NULL);
+  // hits are counted on the records
+  if (vm_own_insns(vm) == ERROR) {
+    return ERROR;
+  }
+
+  while (vm->halted == 0) {
+    // interpreted until a loop header or a callee gets hot
+    if (vm_run_counting(vm) == ERROR) {
+      return ERROR;
+    }
+
+    if (vm->halted) {
+      break;
+    }
+
+    if (jit_entry_at(vm, vm->code_offset) == NULL &&
+        vm_jit_compile_region(vm, vm->code_offset) == ERROR) {
+      // nothing else gets compiled, keep interpreting
+      vm->hot_threshold = UINT32_MAX;
+      continue;
+    }
+
+    // the target has no template, count it again from scratch
+    if (jit_entry_at(vm, vm->code_offset) == NULL) {
+      insn_at(vm, vm->code_offset)->hits = 0;
+      continue;
+    }
+
+    if (jit_run(vm, 1) == ERROR) {
+      return ERROR;
+    }
+
+    // code written natively is not decoded on the records yet
+    for (size_t i = 0; vm->jit != NULL && i < vm->jit->stores_len; i++) {
+      vm_predecode_range(vm, vm->jit->stores[i].from, vm->jit->stores[i].to);
+    }
+  }
+
+  return SUCCESS;
+}
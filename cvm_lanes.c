@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lockstep interpreter for batches: LANES_WIDTH runs of one program go over
+ * its pre-decoded code together, each data stack slot holding the value of
+ * every lane next to each other, so an instruction is dispatched once for
+ * all the lanes on it and the operations of a mode are one fixed-count loop
+ * the compiler turns into vector instructions (see cvm_vector.inc).
+ *
+ * Lanes run together while they are on the same instruction with the same
+ * stack depths. When a branch splits them, the lanes deepest in calls and
+ * then those furthest behind on code go first, which makes the ones that
+ * skipped part of the code wait for the others to reach them, and lanes on
+ * the same instruction with the same depths run together again. Only plain
+ * stack, arithmetic, branch and call opcodes run here. A lane that gets to
+ * anything else, or to an instruction that would raise an error, is left
+ * for a vm, which runs the rest of it as usual from that instruction. */
+
+enum lane_state { LANE_IDLE, LANE_RUNNING, LANE_HALTED, LANE_LEFT };
+
+struct lanes {
+  int64_t data_cap;
+  int64_t call_cap;
+  union value (*data)[LANES_WIDTH]; // slots of all the lanes, cap + 1
+  size_t (*call)[LANES_WIDTH];      // return offsets, cap + 1
+  size_t pc[LANES_WIDTH];
+  int64_t top[LANES_WIDTH];
+  int64_t call_top[LANES_WIDTH];
+  uint8_t state[LANES_WIDTH];
+};
+
+struct lanes *lanes_create(const struct vm *proto) {
+  assert(proto != NULL);
+  struct lanes *lanes = calloc(1, sizeof(struct lanes));
+  if (lanes == NULL) {
+    return NULL;
+  }
+
+  lanes->data_cap = proto->data.cap;
+  lanes->call_cap = proto->call.cap;
+  lanes->data = calloc(proto->data.cap + 1, sizeof(*lanes->data));
+  lanes->call = calloc(proto->call.cap + 1, sizeof(*lanes->call));
+  if (lanes->data == NULL || lanes->call == NULL) {
+    lanes_free(lanes);
+    return NULL;
+  }
+  return lanes;
+}
+
+void lanes_free(struct lanes *lanes) {
+  if (lanes == NULL) {
+    return;
+  }
+
+  free(lanes->data);
+  free(lanes->call);
+  free(lanes);
+}
+
+static struct insn *lanes_insn(const struct vm *proto, size_t offset) {
+  if (offset % 4 != 0 || offset / 4 > proto->insns_count) {
+    return NULL;
+  }
+  return &proto->insns[offset / 4];
+}
+
+// Lanes to run next: the first one deepest in calls and furthest behind on
+// code, and every other one on its instruction with the same depths
+static uint32_t lanes_group(struct lanes *lanes, uint32_t running) {
+  size_t lead = LANES_WIDTH;
+  for (size_t l = 0; l < LANES_WIDTH; l++) {
+    if (!(running >> l & 1)) {
+      continue;
+    }
+    if (lead == LANES_WIDTH || lanes->call_top[l] > lanes->call_top[lead] ||
+        (lanes->call_top[l] == lanes->call_top[lead] &&
+         lanes->pc[l] < lanes->pc[lead])) {
+      lead = l;
+    }
+  }
+
+  uint32_t group = 0;
+  for (size_t l = 0; l < LANES_WIDTH; l++) {
+    if ((running >> l & 1) && lanes->pc[l] == lanes->pc[lead] &&
+        lanes->top[l] == lanes->top[lead] &&
+        lanes->call_top[l] == lanes->call_top[lead]) {
+      group |= 1u << l;
+    }
+  }
+  return group;
+}
+
+// Gives the lanes of the mask their position and depths
+static void lanes_sync(struct lanes *lanes, uint32_t mask, size_t pc,
+                       int64_t top, int64_t call_top) {
+  for (size_t l = 0; l < LANES_WIDTH; l++) {
+    if (mask >> l & 1) {
+      lanes->pc[l] = pc;
+      lanes->top[l] = top;
+      lanes->call_top[l] = call_top;
+    }
+  }
+}
+
+// Copies the data stack of a halted lane to its job
+static void lanes_output(struct lanes *lanes, size_t lane,
+                         struct batch_job *job) {
+  size_t len = lanes->top[lane] + 1;
+  job->error_code = 0;
+  job->outputs_len = len < job->outputs_cap ? len : job->outputs_cap;
+  for (size_t i = 0; i < job->outputs_len; i++) {
+    job->outputs[i] = lanes->data[i][lane];
+  }
+}
+
+#define LANES_ALL ((1u << LANES_WIDTH) - 1)
+
+// Every lane is computed and only those of the mask are kept, with a plain
+// loop when they all are
+#define LANES_MAP(mask, to, expr)                                              \
+  do {                                                                         \
+    if ((mask) == LANES_ALL) {                                                 \
+      for (size_t l = 0; l < LANES_WIDTH; l++) {                               \
+        union value aux = {0LL};                                               \
+        expr;                                                                  \
+        (to)[l] = aux;                                                         \
+      }                                                                        \
+      break;                                                                   \
+    }                                                                          \
+    for (size_t l = 0; l < LANES_WIDTH; l++) {                                 \
+      union value aux = {0LL};                                                 \
+      expr;                                                                    \
+      (to)[l] = (mask) >> l & 1 ? aux : (to)[l];                               \
+    }                                                                          \
+  } while (0)
+
+#define LANES_BINARY(op, sym, mode, member)                                    \
+  case op << 8 | mode:                                                         \
+    LANES_MAP(run, left, aux.member = left[l].member sym right[l].member);     \
+    break;
+
+#define LANES_UNARY(op, sym, mode, member)                                     \
+  case op << 8 | mode:                                                         \
+    LANES_MAP(run, right, aux.member = sym right[l].member);                   \
+    break;
+
+uint32_t lanes_run(struct lanes *lanes, const struct vm *proto,
+                   struct batch_job **jobs, size_t count) {
+  assert(lanes != NULL);
+  assert(proto != NULL && proto->insns != NULL);
+  assert(count <= LANES_WIDTH);
+
+  uint32_t running = 0;
+  for (size_t l = 0; l < LANES_WIDTH; l++) {
+    lanes->state[l] = LANE_IDLE;
+    lanes->pc[l] = 0L;
+    lanes->top[l] = -1;
+    lanes->call_top[l] = -1;
+    if (l >= count) {
+      continue;
+    }
+
+    struct batch_job *job = jobs[l];
+    job->outputs_len = 0;
+    if (job->inputs_len > (size_t)lanes->data_cap) {
+      job->error_code = 0x20;
+      continue;
+    }
+    for (size_t i = 0; i < job->inputs_len; i++) {
+      lanes->data[i][l] = job->inputs[i];
+    }
+    lanes->top[l] = job->inputs_len - 1;
+    lanes->state[l] = LANE_RUNNING;
+    running |= 1u << l;
+  }
+
+  // the lanes of the group share the position and depths below, the arrays
+  // only keep those of the other lanes, or all of them when the group is 0
+  uint32_t left_lanes = 0;
+  uint32_t group = 0;
+  size_t pc = 0L;
+  int64_t top = -1;
+  int64_t call_top = -1;
+  while (running != 0) {
+    if (group != running) {
+      lanes_sync(lanes, group, pc, top, call_top);
+      group = lanes_group(lanes, running);
+      size_t lead = __builtin_ctz(group);
+      pc = lanes->pc[lead];
+      top = lanes->top[lead];
+      call_top = lanes->call_top[lead];
+    }
+
+    size_t at = pc;
+    int64_t depth = top;
+    int64_t calls = call_top;
+    struct insn *insn = lanes_insn(proto, pc);
+    uint32_t leave = 0;
+    if (insn == NULL || insn->op == OP_STEP) {
+      leave = group;
+      goto leave;
+    }
+
+    switch ((enum opcode)insn->opcode) {
+    case NOP:
+      pc = insn->next;
+      break;
+    case HALT:
+      for (size_t l = 0; l < LANES_WIDTH; l++) {
+        if (group >> l & 1) {
+          lanes->state[l] = LANE_HALTED;
+          lanes->top[l] = top;
+          lanes_output(lanes, l, jobs[l]);
+        }
+      }
+      running &= ~group;
+      group = 0;
+      break;
+    case PUSH: {
+      if (top >= lanes->data_cap) {
+        leave = group;
+        break;
+      }
+      union value *slot = lanes->data[top + 1];
+      LANES_MAP(group, slot, aux = insn->imm);
+      top++;
+      pc = insn->next;
+    } break;
+    case POP:
+      if (top < 0) {
+        leave = group;
+        break;
+      }
+      top--;
+      pc = insn->next;
+      break;
+    case SWAP:
+    case ROT3: {
+      int64_t n = insn->opcode == SWAP ? 2 : 3;
+      if (top + 1 < n) {
+        leave = group;
+        break;
+      }
+      union value saved[LANES_WIDTH];
+      memcpy(saved, lanes->data[top], sizeof(saved));
+      for (int64_t i = top; i > top - n + 1; i--) {
+        LANES_MAP(group, lanes->data[i], aux = lanes->data[i - 1][l]);
+      }
+      LANES_MAP(group, lanes->data[top - n + 1], aux = saved[l]);
+      pc = insn->next;
+    } break;
+    case ADD:
+    case SUB:
+    case DIV:
+    case MUL:
+    case MOD:
+    case AND:
+    case OR:
+    case XOR:
+    case NEQ:
+    case EQ:
+    case LT:
+    case LE:
+    case GT:
+    case GE: {
+      if (top < 1) {
+        leave = group;
+        break;
+      }
+      union value *left = lanes->data[top - 1];
+      union value *right = lanes->data[top];
+      union value divisor[LANES_WIDTH];
+      if (insn->opcode == DIV || insn->opcode == MOD) {
+        // lanes dividing by zero raise on a vm, the rest of the lanes that
+        // do not run divide by one
+        for (size_t l = 0; l < LANES_WIDTH; l++) {
+          if ((group >> l & 1) && right[l].u64 == 0LL) {
+            leave |= 1u << l;
+          }
+        }
+        uint32_t dividing = group & ~leave;
+        for (size_t l = 0; l < LANES_WIDTH; l++) {
+          divisor[l].u64 = 1LL;
+          divisor[l] = dividing >> l & 1 ? right[l] : divisor[l];
+        }
+        right = divisor;
+      }
+
+      uint32_t run = group & ~leave;
+      switch (insn->opcode << 8 | insn->mode) {
+        CVM_TYPED_OPS(LANES_BINARY)
+      default:
+        leave = group;
+        break;
+      }
+      top--;
+      pc = insn->next;
+    } break;
+    case NOT: {
+      if (top < 0) {
+        leave = group;
+        break;
+      }
+      union value *right = lanes->data[top];
+      uint32_t run = group;
+      switch (insn->opcode << 8 | insn->mode) {
+        CVM_TYPED_UNARY_OPS(LANES_UNARY)
+      default:
+        leave = group;
+        break;
+      }
+      pc = insn->next;
+    } break;
+    case JNZ:
+    case JZ: {
+      if (top < 0 || insn->target == NULL) {
+        leave = group;
+        break;
+      }
+      uint32_t zero = 0;
+      for (size_t l = 0; l < LANES_WIDTH; l++) {
+        zero |= (uint32_t)(lanes->data[top][l].u64 == 0LL) << l;
+      }
+      uint32_t taken = (insn->opcode == JZ ? zero : ~zero) & group;
+      if (taken == group || taken == 0) {
+        pc = taken != 0 ? insn->target->offset : insn->next;
+        break;
+      }
+
+      // the lanes go their own ways from here
+      lanes_sync(lanes, taken, insn->target->offset, top, call_top);
+      lanes_sync(lanes, group & ~taken, insn->next, top, call_top);
+      group = 0;
+    } break;
+    case JMP:
+      if (insn->target == NULL) {
+        leave = group;
+        break;
+      }
+      pc = insn->target->offset;
+      break;
+    case CALL: {
+      if (insn->target == NULL || call_top >= lanes->call_cap) {
+        leave = group;
+        break;
+      }
+      size_t *slot = lanes->call[call_top + 1];
+      for (size_t l = 0; l < LANES_WIDTH; l++) {
+        slot[l] = group >> l & 1 ? insn->next : slot[l];
+      }
+      call_top++;
+      pc = insn->target->offset;
+    } break;
+    case RET: {
+      if (call_top < 0) {
+        leave = group;
+        break;
+      }
+      size_t *slot = lanes->call[call_top];
+      size_t ret = slot[__builtin_ctz(group)];
+      int same = 1;
+      for (size_t l = 0; l < LANES_WIDTH; l++) {
+        same &= !(group >> l & 1) || slot[l] == ret;
+      }
+      call_top--;
+      if (same) {
+        pc = ret;
+        break;
+      }
+
+      // called from different places
+      for (size_t l = 0; l < LANES_WIDTH; l++) {
+        if (group >> l & 1) {
+          lanes_sync(lanes, 1u << l, slot[l], top, call_top);
+        }
+      }
+      group = 0;
+    } break;
+    default:
+      leave = group;
+      break;
+    }
+
+  leave:
+    if (leave != 0) {
+      // the vm runs again the instruction the lanes stopped on
+      lanes_sync(lanes, leave, at, depth, calls);
+      for (size_t l = 0; l < LANES_WIDTH; l++) {
+        if (leave >> l & 1) {
+          lanes->state[l] = LANE_LEFT;
+        }
+      }
+      left_lanes |= leave;
+      running &= ~leave;
+      group &= ~leave;
+    }
+  }
+
+  return left_lanes;
+}
+
+#undef LANES_UNARY
+#undef LANES_BINARY
+#undef LANES_MAP
+#undef LANES_ALL
+
+void lanes_leave(struct lanes *lanes, size_t lane, struct vm *vm) {
+  assert(lanes != NULL);
+  assert(lane < LANES_WIDTH && lanes->state[lane] == LANE_LEFT);
+  assert(vm != NULL);
+  for (int64_t i = 0; i <= lanes->top[lane]; i++) {
+    vm->data.bot[i] = lanes->data[i][lane];
+  }
+  for (int64_t i = 0; i <= lanes->call_top[lane]; i++) {
+    vm->call.bot[i].size = lanes->call[i][lane];
+  }
+
+  // the vm runs the instruction the lane stopped on
+  vm->data.top = lanes->top[lane];
+  vm->call.top = lanes->call_top[lane];
+  vm->code_offset = lanes->pc[lane];
+  lanes->state[lane] = LANE_IDLE;
+}
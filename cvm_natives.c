@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Host functions reached with NATIVE, which indexes vm->natives and makes an
+ * indirect call, with no lookup by name at runtime. A native works on the
+ * stacks itself, and on failure sets the error with vm_set_error and returns
+ * ERROR so the handler runs. */
+
+void dummy();
+
+retcode vm_register_native(struct vm *vm, size_t index,
+                           ffi_entry_point native) {
+  assert(vm != NULL);
+  if (index >= MAX_NATIVES) {
+    fprintf(stderr, "error: native index %zu out of range\n", index);
+    return ERROR;
+  }
+
+  if (index >= vm->natives_count) {
+    size_t count = vm->natives_count == 0 ? 16 : vm->natives_count;
+    while (count <= index) {
+      count *= 2;
+    }
+
+    ffi_entry_point *natives =
+        realloc(vm->natives, sizeof(ffi_entry_point) * count);
+    if (natives == NULL) {
+      fprintf(stderr, "error: cannot grow the natives table\n");
+      return ERROR;
+    }
+
+    memset(natives + vm->natives_count, 0,
+           sizeof(ffi_entry_point) * (count - vm->natives_count));
+    vm->natives = natives;
+    vm->natives_count = count;
+  }
+
+  vm->natives[index] = native;
+  return SUCCESS;
+}
+
+// Pops an address and a size of reserved memory on the data segment
+static retcode native_block(struct vm *vm, uint8_t **bytes, size_t *size) {
+  union value v_size = {0LL};
+  union value v_address = {0LL};
+  if (vm->data.top < 1) {
+    vm_set_error(vm, 0x10, "missing stack parameters (native)");
+    return ERROR;
+  }
+
+  stack_pop(&vm->data, &v_size);
+  stack_pop(&vm->data, &v_address);
+  if (!heap_is_reserved(&vm->heap, v_address.size, v_size.size)) {
+    vm_set_error(vm, 0x24, "memory access outside reserved memory (native)");
+    return ERROR;
+  }
+
+  *bytes = vm->heap.base + v_address.size;
+  *size = v_size.size;
+  return SUCCESS;
+}
+
+static retcode native_dummy(struct vm *vm) {
+  (void)vm;
+  dummy();
+  return SUCCESS;
+}
+
+static retcode native_clock(struct vm *vm) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  union value v = {.u64 = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec};
+  if (stack_push(&vm->data, v) == ERROR) {
+    vm_set_error(vm, 0x20, "stack overflow (native)");
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+static retcode native_hash(struct vm *vm) {
+  uint8_t *bytes = NULL;
+  size_t size = 0;
+  if (native_block(vm, &bytes, &size) == ERROR) {
+    return ERROR;
+  }
+
+  union value v = {.u64 = 0xCBF29CE484222325};
+  for (size_t i = 0; i < size; i++) {
+    v.u64 = (v.u64 ^ bytes[i]) * 0x100000001B3;
+  }
+  stack_push(&vm->data, v);
+  return SUCCESS;
+}
+
+static retcode native_log(struct vm *vm) {
+  uint8_t *bytes = NULL;
+  size_t size = 0;
+  if (native_block(vm, &bytes, &size) == ERROR) {
+    return ERROR;
+  }
+
+  fwrite(bytes, 1, size, stdout);
+  putchar('\n');
+  return SUCCESS;
+}
+
+retcode vm_register_natives(struct vm *vm) {
+#define CVM_NATIVE(index, name)                                                \
+  if (vm_register_native(vm, index, native_##name) == ERROR) {                 \
+    return ERROR;                                                              \
+  }
+#include "cvm_natives.def"
+#undef CVM_NATIVE
+  return SUCCESS;
+}
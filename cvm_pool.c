@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Batches of jobs of one program over a pool of workers, one per core. Each
+ * worker keeps a vm of the program and resets it between jobs. A batch is
+ * split in one range of jobs per worker, owners take jobs from the front of
+ * their range and a worker with nothing left steals the back half of the
+ * range of another one, so jobs that run longer than the rest get spread.
+ * Results go to the jobs themselves, in the order they were given. With
+ * lanes on, workers take LANES_WIDTH jobs at a time and run them in lockstep
+ * (see cvm_lanes.c), and only the lanes that leave the lockstep run on the
+ * vm of the worker. */
+
+struct pool_worker {
+  struct pool *pool;
+  pthread_t thread;
+  pthread_mutex_t lock; // guards begin and end
+  size_t begin;         // jobs left, [begin, end)
+  size_t end;
+  struct vm vm;
+  struct lanes *lanes; // made on the first batch with lanes
+  int ready;           // vm initialized
+  int used;            // vm ran a job since it was reset
+};
+
+struct pool {
+  struct program *program;
+  struct pool_worker *workers;
+  size_t workers_count;
+  pthread_mutex_t lock; // guards the fields below
+  pthread_cond_t start;
+  pthread_cond_t done;
+  struct batch_job *jobs;
+  size_t remaining; // jobs of the batch not finished yet
+  size_t batch;     // number of the batch, workers wait for a new one
+  size_t idle;      // workers waiting for a batch
+  int lanes;        // run the jobs of a batch in lockstep
+  int stopping;
+};
+
+static int pool_take(struct pool_worker *worker, size_t *job) {
+  pthread_mutex_lock(&worker->lock);
+  int taken = worker->begin < worker->end;
+  if (taken) {
+    *job = worker->begin++;
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return taken;
+}
+
+static int pool_steal(struct pool_worker *thief, size_t *job) {
+  struct pool *pool = thief->pool;
+  size_t self = thief - pool->workers;
+  for (size_t i = 1; i < pool->workers_count; i++) {
+    struct pool_worker *victim =
+        &pool->workers[(self + i) % pool->workers_count];
+    pthread_mutex_lock(&victim->lock);
+    size_t left = victim->end - victim->begin;
+    if (left == 0) {
+      pthread_mutex_unlock(&victim->lock);
+      continue;
+    }
+
+    size_t middle = victim->end - (left + 1) / 2;
+    size_t end = victim->end;
+    victim->end = middle;
+    pthread_mutex_unlock(&victim->lock);
+
+    // one job now, the rest of the half goes to the range of the thief
+    pthread_mutex_lock(&thief->lock);
+    thief->begin = middle + 1;
+    thief->end = end;
+    pthread_mutex_unlock(&thief->lock);
+    *job = middle;
+    return 1;
+  }
+  return 0;
+}
+
+// Gets the vm of the worker as it was made for the program
+static retcode pool_reset(struct pool_worker *worker) {
+  if (!worker->ready) {
+    return ERROR;
+  }
+  if (worker->used &&
+      program_reset(worker->pool->program, &worker->vm) == ERROR) {
+    return ERROR;
+  }
+  worker->used = 1;
+  return SUCCESS;
+}
+
+// Runs the vm of the worker until it stops, with the job's results
+static void pool_finish(struct pool_worker *worker, struct batch_job *job) {
+  struct vm *vm = &worker->vm;
+  if (vm_run(vm) == ERROR) {
+    job->error_code = vm->error_code != 0 ? vm->error_code : -1;
+    return;
+  }
+
+  job->error_code = 0;
+  size_t len = vm->data.top + 1;
+  job->outputs_len = len < job->outputs_cap ? len : job->outputs_cap;
+  memcpy(job->outputs, vm->data.bot, sizeof(union value) * job->outputs_len);
+}
+
+static void pool_run_job(struct pool_worker *worker, struct batch_job *job) {
+  struct vm *vm = &worker->vm;
+  job->outputs_len = 0;
+  if (pool_reset(worker) == ERROR) {
+    job->error_code = -1;
+    return;
+  }
+
+  if (job->inputs_len > (size_t)vm->data.cap) {
+    job->error_code = 0x20;
+    return;
+  }
+  for (size_t i = 0; i < job->inputs_len; i++) {
+    vm->data.bot[++vm->data.top] = job->inputs[i];
+  }
+  pool_finish(worker, job);
+}
+
+static void pool_run_lanes(struct pool_worker *worker,
+                           struct batch_job **group, size_t count) {
+  const struct vm *proto = program_proto(worker->pool->program);
+  uint32_t left = lanes_run(worker->lanes, proto, group, count);
+  for (size_t l = 0; l < count; l++) {
+    if (!(left >> l & 1)) {
+      continue;
+    }
+    if (pool_reset(worker) == ERROR) {
+      group[l]->error_code = -1;
+      continue;
+    }
+    lanes_leave(worker->lanes, l, &worker->vm);
+    pool_finish(worker, group[l]);
+  }
+}
+
+static void pool_done(struct pool *pool, size_t count) {
+  if (__atomic_sub_fetch(&pool->remaining, count, __ATOMIC_ACQ_REL) == 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void *pool_work(void *data) {
+  struct pool_worker *worker = data;
+  struct pool *pool = worker->pool;
+  worker->ready = vm_init_program(&worker->vm, pool->program) == SUCCESS;
+
+  size_t batch = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    pool->idle++;
+    pthread_cond_broadcast(&pool->done);
+    while (pool->batch == batch && !pool->stopping) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    pool->idle--;
+    batch = pool->batch;
+    struct batch_job *jobs = pool->jobs;
+    int lanes = pool->lanes;
+    int stopping = pool->stopping;
+    pthread_mutex_unlock(&pool->lock);
+    if (stopping) {
+      break;
+    }
+
+    if (lanes && worker->lanes == NULL) {
+      worker->lanes = lanes_create(program_proto(pool->program));
+    }
+
+    size_t job = 0;
+    if (lanes && worker->lanes != NULL) {
+      struct batch_job *group[LANES_WIDTH];
+      size_t count = 0;
+      do {
+        count = 0;
+        while (count < LANES_WIDTH &&
+               (pool_take(worker, &job) || pool_steal(worker, &job))) {
+          group[count++] = &jobs[job];
+        }
+        if (count > 0) {
+          pool_run_lanes(worker, group, count);
+          pool_done(pool, count);
+        }
+      } while (count > 0);
+      continue;
+    }
+
+    while (pool_take(worker, &job) || pool_steal(worker, &job)) {
+      pool_run_job(worker, &jobs[job]);
+      pool_done(pool, 1);
+    }
+  }
+
+  lanes_free(worker->lanes);
+  vm_free(&worker->vm);
+  return NULL;
+}
+
+struct pool *pool_create(struct program *program, size_t workers) {
+  assert(program != NULL);
+  if (workers == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cores > 0 ? cores : 1;
+  }
+
+  struct pool *pool = calloc(1, sizeof(struct pool));
+  if (pool == NULL) {
+    fprintf(stderr, "error: cannot allocate pool\n");
+    return NULL;
+  }
+  pool->workers = calloc(workers, sizeof(struct pool_worker));
+  if (pool->workers == NULL) {
+    fprintf(stderr, "error: cannot allocate pool\n");
+    free(pool);
+    return NULL;
+  }
+
+  pool->program = program_retain(program);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (size_t i = 0; i < workers; i++) {
+    struct pool_worker *worker = &pool->workers[i];
+    worker->pool = pool;
+    pthread_mutex_init(&worker->lock, NULL);
+    if (pthread_create(&worker->thread, NULL, pool_work, worker) != 0) {
+      fprintf(stderr, "error: cannot start pool worker\n");
+      break;
+    }
+    pool->workers_count++;
+  }
+
+  if (pool->workers_count == 0) {
+    pool_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+retcode pool_lanes(struct pool *pool, int lanes) {
+  assert(pool != NULL);
+  if (lanes && program_proto(pool->program)->insns == NULL) {
+    fprintf(stderr, "error: lanes run pre-decoded code only\n");
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->lanes = lanes;
+  pthread_mutex_unlock(&pool->lock);
+  return SUCCESS;
+}
+
+retcode pool_run(struct pool *pool, struct batch_job *jobs, size_t count) {
+  assert(pool != NULL);
+  if (count == 0) {
+    return SUCCESS;
+  }
+
+  // workers still looking for jobs of the last batch would take these ones
+  // with the jobs of that batch
+  size_t workers = pool->workers_count;
+  pthread_mutex_lock(&pool->lock);
+  while (pool->idle < workers) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+
+  // contiguous ranges, so each worker starts on its own part of the batch
+  for (size_t i = 0; i < workers; i++) {
+    struct pool_worker *worker = &pool->workers[i];
+    pthread_mutex_lock(&worker->lock);
+    worker->begin = count * i / workers;
+    worker->end = count * (i + 1) / workers;
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  pool->jobs = jobs;
+  pool->remaining = count;
+  pool->batch++;
+  pthread_cond_broadcast(&pool->start);
+  while (__atomic_load_n(&pool->remaining, __ATOMIC_ACQUIRE) > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return SUCCESS;
+}
+
+size_t pool_workers(struct pool *pool) { return pool->workers_count; }
+
+void pool_free(struct pool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->workers_count; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    pthread_mutex_destroy(&pool->workers[i].lock);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  program_release(pool->program);
+  free(pool->workers);
+  free(pool);
+}
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Profiled mode, the checked threaded loop with counters: instructions run
+ * at each offset, calls and errors handled at each target with the cycles
+ * (rdtsc) spent until they return, which include the callees. Code is not
+ * fused, so every instruction is counted on its own, and the report gives
+ * how many times the sequences of cvm_fusion.def ran back to back, the
+ * counts that file takes. The report is JSON, or CSV when the name of the
+ * file ends with .csv. */
+
+struct profile_op {
+  uint8_t opcode;
+  uint8_t mode;
+  uint64_t count;
+};
+
+retcode profile_init(struct vm *vm) {
+  assert(vm != NULL);
+  assert(vm->insns != NULL);
+  struct profile *profile = calloc(1, sizeof(struct profile));
+  if (profile == NULL) {
+    fprintf(stderr, "error: cannot allocate profile\n");
+    return ERROR;
+  }
+
+  profile->slots = vm->insns_count + 1;
+  profile->depth = vm->call.cap + 1;
+  profile->counts = calloc(profile->slots, sizeof(uint64_t));
+  profile->calls = calloc(profile->slots, sizeof(uint64_t));
+  profile->cycles = calloc(profile->slots, sizeof(uint64_t));
+  profile->handled = calloc(profile->slots, sizeof(uint64_t));
+  profile->frames = calloc(profile->depth, sizeof(struct profile_frame));
+  vm->profile = profile;
+  if (profile->counts == NULL || profile->calls == NULL ||
+      profile->cycles == NULL || profile->handled == NULL ||
+      profile->frames == NULL) {
+    fprintf(stderr, "error: cannot allocate profile\n");
+    profile_free(vm);
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+static int profile_op_compare(const void *a, const void *b) {
+  const struct profile_op *left = a;
+  const struct profile_op *right = b;
+  if (left->count != right->count) {
+    return left->count < right->count ? 1 : -1;
+  }
+  return (left->opcode << 8 | left->mode) - (right->opcode << 8 | right->mode);
+}
+
+// Counts by opcode and mode, most run first
+static size_t profile_ops(struct vm *vm, struct profile_op *ops) {
+  struct profile *profile = vm->profile;
+  size_t len = 0;
+  for (size_t slot = 0; slot < vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    uint64_t count = profile->counts[slot];
+    if (count == 0) {
+      continue;
+    }
+
+    size_t i = 0;
+    while (i < len &&
+           (ops[i].opcode != insn->opcode || ops[i].mode != insn->mode)) {
+      i++;
+    }
+    if (i == len) {
+      ops[len].opcode = insn->opcode;
+      ops[len].mode = insn->mode;
+      ops[len++].count = 0;
+    }
+    ops[i].count += count;
+  }
+
+  qsort(ops, len, sizeof(struct profile_op), profile_op_compare);
+  return len;
+}
+
+static void profile_json(struct vm *vm, FILE *out, struct profile_op *ops,
+                         size_t ops_len, uint64_t total) {
+  struct profile *profile = vm->profile;
+  const char *sep = "";
+  fprintf(out, "{\n  \"instructions\": %lu,\n  \"opcodes\": [", total);
+  for (size_t i = 0; i < ops_len; i++, sep = ",") {
+    fprintf(out, "%s\n    {\"opcode\": %u, \"mode\": %u, \"count\": %lu}", sep,
+            ops[i].opcode, ops[i].mode, ops[i].count);
+  }
+
+  sep = "";
+  fprintf(out, "\n  ],\n  \"offsets\": [");
+  for (size_t slot = 0; slot < vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    if (profile->counts[slot] == 0) {
+      continue;
+    }
+    fprintf(out,
+            "%s\n    {\"offset\": %lu, \"opcode\": %u, \"mode\": %u, "
+            "\"count\": %lu}",
+            sep, insn->offset, insn->opcode, insn->mode,
+            profile->counts[slot]);
+    sep = ",";
+  }
+
+  sep = "";
+  fprintf(out, "\n  ],\n  \"calls\": [");
+  for (size_t slot = 0; slot < profile->slots; slot++) {
+    if (profile->calls[slot] == 0) {
+      continue;
+    }
+    fprintf(out, "%s\n    {\"offset\": %lu, \"calls\": %lu, \"cycles\": %lu}",
+            sep, slot * 4, profile->calls[slot], profile->cycles[slot]);
+    sep = ",";
+  }
+
+  sep = "";
+  fprintf(out, "\n  ],\n  \"handlers\": [");
+  for (size_t slot = 0; slot < profile->slots; slot++) {
+    if (profile->handled[slot] == 0) {
+      continue;
+    }
+    fprintf(out, "%s\n    {\"offset\": %lu, \"errors\": %lu}", sep, slot * 4,
+            profile->handled[slot]);
+    sep = ",";
+  }
+
+  sep = "";
+  fprintf(out, "\n  ],\n  \"fusions\": [");
+  for (size_t i = 0; i < fusions_count(); i++, sep = ",") {
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"count\": %lu}", sep,
+            fusion_name(i), fusion_profile(vm, i, profile->counts));
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+static void profile_csv(struct vm *vm, FILE *out, struct profile_op *ops,
+                        size_t ops_len, uint64_t total) {
+  struct profile *profile = vm->profile;
+  fprintf(out, "kind,name,offset,opcode,mode,count,cycles\n");
+  fprintf(out, "instructions,,,,,%lu,\n", total);
+  for (size_t i = 0; i < ops_len; i++) {
+    fprintf(out, "opcode,,,%u,%u,%lu,\n", ops[i].opcode, ops[i].mode,
+            ops[i].count);
+  }
+
+  for (size_t slot = 0; slot < vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    if (profile->counts[slot] != 0) {
+      fprintf(out, "offset,,%lu,%u,%u,%lu,\n", insn->offset, insn->opcode,
+              insn->mode, profile->counts[slot]);
+    }
+  }
+
+  for (size_t slot = 0; slot < profile->slots; slot++) {
+    if (profile->calls[slot] != 0) {
+      fprintf(out, "call,,%lu,,,%lu,%lu\n", slot * 4, profile->calls[slot],
+              profile->cycles[slot]);
+    }
+  }
+
+  for (size_t slot = 0; slot < profile->slots; slot++) {
+    if (profile->handled[slot] != 0) {
+      fprintf(out, "handler,,%lu,,,%lu,\n", slot * 4, profile->handled[slot]);
+    }
+  }
+
+  for (size_t i = 0; i < fusions_count(); i++) {
+    fprintf(out, "fusion,%s,,,,%lu,\n", fusion_name(i),
+            fusion_profile(vm, i, profile->counts));
+  }
+}
+
+retcode profile_write(struct vm *vm, const char *filename) {
+  assert(vm != NULL);
+  assert(filename != NULL);
+  struct profile *profile = vm->profile;
+  if (profile == NULL) {
+    fprintf(stderr, "error: nothing was profiled\n");
+    return ERROR;
+  }
+
+  // the code may have been decoded again, but never to fewer slots
+  assert(vm->insns_count < profile->slots);
+  struct profile_op *ops = malloc(sizeof(struct profile_op) * profile->slots);
+  if (ops == NULL) {
+    fprintf(stderr, "error: cannot allocate profile report\n");
+    return ERROR;
+  }
+
+  FILE *out = fopen(filename, "w");
+  if (out == NULL) {
+    perror("open profile");
+    free(ops);
+    return ERROR;
+  }
+
+  uint64_t total = 0;
+  for (size_t slot = 0; slot < profile->slots; slot++) {
+    total += profile->counts[slot];
+  }
+
+  size_t ops_len = profile_ops(vm, ops);
+  size_t len = strlen(filename);
+  if (len >= 4 && strcmp(filename + len - 4, ".csv") == 0) {
+    profile_csv(vm, out, ops, ops_len, total);
+  } else {
+    profile_json(vm, out, ops, ops_len, total);
+  }
+
+  free(ops);
+  if (fclose(out) != 0) {
+    perror("write profile");
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+void profile_free(struct vm *vm) {
+  assert(vm != NULL);
+  struct profile *profile = vm->profile;
+  if (profile == NULL) {
+    return;
+  }
+
+  free(profile->counts);
+  free(profile->calls);
+  free(profile->cycles);
+  free(profile->handled);
+  free(profile->frames);
+  free(profile);
+  vm->profile = NULL;
+}
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Programs, for running many vms of the same image. A program takes over a
+ * vm the host loaded and configured and prepares it once: imports made,
+ * code pre-decoded, fused, verified and linked to the handlers of its exec
+ * mode. It never runs. Its code goes to a memfd that every instance maps
+ * private, so instances share the pages until they write to them, and they
+ * read the pre-decoded records of the program until they need to change
+ * them (see vm_own_insns). An instance is then its stacks, data segment and
+ * error state. */
+
+struct program {
+  struct vm proto; // prepared once, never runs
+  int fd;          // memfd with the code instances map
+  size_t refs;     // the host and every instance
+};
+
+struct program *program_create(struct vm *proto) {
+  assert(proto != NULL);
+  struct program *program = malloc(sizeof(struct program));
+  if (program == NULL) {
+    fprintf(stderr, "error: cannot allocate program\n");
+    vm_free(proto);
+    return NULL;
+  }
+
+  program->proto = *proto;
+  program->fd = -1;
+  program->refs = 1;
+  struct vm *vm = &program->proto;
+  if (ffi_imports_wait(vm) == ERROR) {
+    program_release(program);
+    return NULL;
+  }
+
+  if (vm->exec_mode != EXEC_STEP && vm->exec_mode != EXEC_AOT &&
+      vm->insns == NULL && vm_predecode(vm) == ERROR) {
+    program_release(program);
+    return NULL;
+  }
+  if (vm->exec_mode == EXEC_VERIFIED && !vm->verified &&
+      vm_verify(vm) == ERROR) {
+    fprintf(stderr, "code not verified, running with runtime checks\n");
+  }
+
+  // a halted vm only gets its records linked
+  vm->halted = 1;
+  if (vm->exec_mode == EXEC_VERIFIED) {
+    vm_run_verified(vm);
+  } else if (vm->exec_mode != EXEC_STEP && vm->exec_mode != EXEC_AOT) {
+    vm_run_threaded(vm);
+  }
+  vm->halted = 0;
+
+  program->fd = memfd_create("cvm program", MFD_CLOEXEC);
+  if (program->fd < 0 || ftruncate(program->fd, vm->code_size) != 0 ||
+      (vm->code_size > 0 &&
+       pwrite(program->fd, vm->code, vm->code_size, 0) !=
+           (ssize_t)vm->code_size)) {
+    perror("program image");
+    program_release(program);
+    return NULL;
+  }
+  return program;
+}
+
+struct program *program_retain(struct program *program) {
+  assert(program != NULL);
+  __atomic_add_fetch(&program->refs, 1, __ATOMIC_RELAXED);
+  return program;
+}
+
+void program_release(struct program *program) {
+  if (program == NULL ||
+      __atomic_sub_fetch(&program->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+
+  vm_free(&program->proto);
+  if (program->fd >= 0) {
+    close(program->fd);
+  }
+  free(program);
+}
+
+retcode program_map(struct program *program, struct vm *vm) {
+  struct vm *proto = &program->proto;
+  static uint8_t no_code[4];
+  vm->code = no_code;
+  vm->code_size = proto->code_size;
+  if (vm->code_size > 0) {
+    void *code = mmap(NULL, vm->code_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, program->fd, 0);
+    if (code == MAP_FAILED) {
+      perror("map program");
+      vm->code_size = 0L;
+      return ERROR;
+    }
+    vm->code = code;
+    vm->code_mapped = vm->code_size;
+  }
+
+  if (proto->natives_count > 0) {
+    size_t size = sizeof(ffi_entry_point) * proto->natives_count;
+    vm->natives = malloc(size);
+    if (vm->natives == NULL) {
+      fprintf(stderr, "error: cannot allocate the natives table\n");
+      return ERROR;
+    }
+    memcpy(vm->natives, proto->natives, size);
+    vm->natives_count = proto->natives_count;
+  }
+
+  vm->program = program_retain(program);
+  vm->quiet = proto->quiet;
+  vm->exec_mode = proto->exec_mode;
+  vm->fuse = proto->fuse;
+  vm->hot_threshold = proto->hot_threshold;
+  vm->aot_run = proto->aot_run;
+  vm->ffi_ext_exec_mode = proto->ffi_ext_exec_mode;
+  vm->insns = proto->insns;
+  vm->insns_count = proto->insns_count;
+  vm->insns_labels = proto->insns_labels;
+  vm->insns_shared = proto->insns != NULL;
+  vm->verified = proto->verified;
+  return SUCCESS;
+}
+
+// Makes vm as vm_init_program left it, reusing its stacks and data segment
+retcode program_reset(struct program *program, struct vm *vm) {
+  assert(vm->program == program);
+  struct vm *proto = &program->proto;
+
+  // private copies of the pages written are dropped and the image is read
+  // again
+  if (vm->code_mapped > 0 &&
+      madvise(vm->code, vm->code_mapped, MADV_DONTNEED) != 0) {
+    return ERROR;
+  }
+  if (!vm->insns_shared && proto->insns != NULL) {
+    free(vm->insns);
+    vm_jit_free(vm);
+    vm->insns = proto->insns;
+    vm->insns_count = proto->insns_count;
+    vm->insns_labels = proto->insns_labels;
+    vm->insns_shared = 1;
+  }
+  vm->verified = proto->verified;
+  vm->hot_threshold = proto->hot_threshold;
+
+  io_drain(vm);
+  fibers_free(vm);
+  vm->data.top = -1;
+  vm->call.top = -1;
+  heap_clear(&vm->heap);
+  if (vm->error_message != NULL && vm->should_free_error) {
+    free(vm->error_message);
+  }
+  vm->error_message = NULL;
+  vm->should_free_error = 0;
+  vm->error_code = 0;
+  vm->error_handler = 0L;
+  vm->code_offset = 0L;
+  vm->halted = 0;
+
+  // libraries and externs the last run made, the first lib is cvm itself
+  union value libref;
+  while (vm->ffi_libs.top > 0 && stack_pop(&vm->ffi_libs, &libref) == SUCCESS) {
+    dlclose(libref.data);
+  }
+  vm->ffi_selected_lib = 0;
+  if (vm->ffi_ext_page_used > 0 || vm->ffi_ext_exec_mode) {
+    mprotect(vm->ffi_ext_page, vm->ffi_ext_page_size, PROT_READ | PROT_WRITE);
+  }
+  vm->ffi_ext_page_used = 0L;
+  vm->ffi_ext_exec_mode = proto->ffi_ext_exec_mode;
+  return SUCCESS;
+}
+
+const struct vm *program_proto(struct program *program) {
+  return &program->proto;
+}
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* Sampling profiler: a SIGPROF timer on the cpu time of the process takes
+ * code_offset and the return addresses on the call stack of the vm, and the
+ * handler adds the sample to a table of the stacks seen so far, made before
+ * the timer starts, so it never allocates. The interpreters only update
+ * code_offset on taken branches, calls and returns, which is enough to tell
+ * the label each sample is under, and native code is sampled where it was
+ * entered. When the run ends the stacks are written folded, one per line
+ * with its frames from the outermost call and the samples taken, named by
+ * the labels of the symbol file chasm writes (--symbols) or by their offset
+ * without one. */
+
+#define SAMPLE_DEPTH 64     // frames kept, the innermost ones
+#define SAMPLE_STACKS 4096  // different stacks, a power of two
+#define SAMPLE_WORDS 262144 // offsets of all the stacks together
+
+struct sample_stack {
+  uint64_t hash;
+  size_t start; // on words, the first one is the number of frames
+  uint64_t count;
+};
+
+static struct sampler {
+  struct vm *vm;
+  struct sample_stack *stacks;
+  size_t *words;
+  size_t words_len;
+  uint64_t dropped; // samples that did not fit
+} sampler;
+
+static void sample_signal(int signal) {
+  (void)signal;
+  struct vm *vm = sampler.vm;
+  size_t frames[SAMPLE_DEPTH];
+  size_t len = 0;
+
+  // the call that made each frame is the word before its return address
+  int64_t top = vm->call.top;
+  if (top > vm->call.cap) {
+    top = vm->call.cap;
+  }
+  int64_t first = top - (SAMPLE_DEPTH - 1) + 1;
+  for (int64_t i = first > 0 ? first : 0; i <= top; i++) {
+    size_t ret = vm->call.bot[i].size;
+    frames[len++] = ret >= 4 ? ret - 4 : 0;
+  }
+  frames[len++] = vm->code_offset;
+
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ frames[i]) * 1099511628211ULL;
+  }
+
+  for (size_t probe = 0; probe < SAMPLE_STACKS; probe++) {
+    struct sample_stack *stack =
+        &sampler.stacks[(hash + probe) & (SAMPLE_STACKS - 1)];
+    if (stack->count == 0) {
+      if (sampler.words_len + len + 1 > SAMPLE_WORDS) {
+        break;
+      }
+      stack->hash = hash;
+      stack->start = sampler.words_len;
+      sampler.words[sampler.words_len++] = len;
+      memcpy(&sampler.words[sampler.words_len], frames, sizeof(size_t) * len);
+      sampler.words_len += len;
+      stack->count = 1;
+      return;
+    }
+
+    size_t *words = &sampler.words[stack->start];
+    if (stack->hash == hash && words[0] == len &&
+        memcmp(words + 1, frames, sizeof(size_t) * len) == 0) {
+      stack->count++;
+      return;
+    }
+  }
+  sampler.dropped++;
+}
+
+// Drops the samples of a sampler that could not start
+static void sample_discard(void) {
+  free(sampler.stacks);
+  free(sampler.words);
+  memset(&sampler, 0, sizeof(sampler));
+}
+
+retcode sample_start(struct vm *vm, unsigned hz) {
+  assert(vm != NULL);
+  assert(sampler.vm == NULL);
+  sampler.stacks = calloc(SAMPLE_STACKS, sizeof(struct sample_stack));
+  sampler.words = malloc(sizeof(size_t) * SAMPLE_WORDS);
+  if (sampler.stacks == NULL || sampler.words == NULL) {
+    fprintf(stderr, "error: cannot allocate samples\n");
+    sample_discard();
+    return ERROR;
+  }
+  sampler.vm = vm;
+  sampler.words_len = 0;
+  sampler.dropped = 0;
+
+  struct sigaction action;
+  struct sigaction previous;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = sample_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &previous) != 0) {
+    perror("sample signal");
+    sample_discard();
+    return ERROR;
+  }
+
+  // tv_usec has to stay under a second
+  long period = 1000000 / (hz > 0 ? hz : 1);
+  if (period == 0) {
+    period = 1;
+  }
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_interval.tv_sec = period / 1000000;
+  timer.it_interval.tv_usec = period % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    perror("sample timer");
+    sigaction(SIGPROF, &previous, NULL);
+    sample_discard();
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+// Label the offset is under, the last one at or before it
+static void sample_print(const struct symbols *symbols, FILE *out,
+                         size_t offset) {
+  const struct symbol *label = symbol_label(symbols, offset);
+  if (label == NULL) {
+    fprintf(out, "0x%lx", offset);
+  } else {
+    fputs(label->name, out);
+  }
+}
+
+retcode sample_stop(struct vm *vm, const char *filename,
+                    const char *symbols_filename) {
+  assert(vm != NULL && sampler.vm == vm);
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+
+  retcode rc = SUCCESS;
+  struct symbols symbols;
+  memset(&symbols, 0, sizeof(symbols));
+  if (symbols_filename != NULL &&
+      symbols_load(&symbols, symbols_filename) == ERROR) {
+    rc = ERROR;
+  }
+
+  // stacks with the same labels are merged by the flame graph tools
+  FILE *out = fopen(filename, "w");
+  if (out == NULL) {
+    perror("open samples");
+    rc = ERROR;
+  }
+  for (size_t i = 0; out != NULL && i < SAMPLE_STACKS; i++) {
+    struct sample_stack *stack = &sampler.stacks[i];
+    if (stack->count == 0) {
+      continue;
+    }
+
+    size_t *words = &sampler.words[stack->start];
+    for (size_t frame = 0; frame < words[0]; frame++) {
+      if (frame > 0) {
+        fputc(';', out);
+      }
+      sample_print(&symbols, out, words[1 + frame]);
+    }
+    fprintf(out, " %lu\n", stack->count);
+  }
+  if (out != NULL && fclose(out) != 0) {
+    perror("write samples");
+    rc = ERROR;
+  }
+  if (sampler.dropped > 0) {
+    fprintf(stderr, "warning: %lu samples did not fit\n", sampler.dropped);
+  }
+
+  symbols_free(&symbols);
+  sample_discard();
+  return rc;
+}
@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Symbol files written by chasm --symbols, with the offset of every label
+ * and the source line of every instruction. They name offsets for the
+ * sampling profiler and the trace decoder (cvmtrace). */
+
+static int symbol_compare(const void *a, const void *b) {
+  const struct symbol *left = a;
+  const struct symbol *right = b;
+  return (left->offset > right->offset) - (left->offset < right->offset);
+}
+
+static retcode symbols_add(struct symbol **all, size_t *len, size_t *cap,
+                           size_t offset, const char *name, size_t line) {
+  if (*len == *cap) {
+    *cap = *cap > 0 ? *cap * 2 : 64;
+    struct symbol *grown = realloc(*all, sizeof(struct symbol) * *cap);
+    if (grown == NULL) {
+      return ERROR;
+    }
+    *all = grown;
+  }
+
+  struct symbol *symbol = &(*all)[(*len)++];
+  symbol->offset = offset;
+  symbol->name = name != NULL ? strdup(name) : NULL;
+  symbol->line = line;
+  return SUCCESS;
+}
+
+retcode symbols_load(struct symbols *symbols, const char *filename) {
+  FILE *in = fopen(filename, "r");
+  if (in == NULL) {
+    perror("open symbols");
+    return ERROR;
+  }
+
+  size_t labels_cap = 0;
+  size_t lines_cap = 0;
+  char text[1024];
+  char name[1024];
+  size_t offset = 0;
+  size_t line = 0;
+  retcode rc = SUCCESS;
+  while (rc == SUCCESS && fgets(text, sizeof(text), in) != NULL) {
+    if (sscanf(text, "label %zu %1023s", &offset, name) == 2) {
+      rc = symbols_add(&symbols->labels, &symbols->labels_len, &labels_cap,
+                       offset, name, 0);
+    } else if (sscanf(text, "line %zu %zu", &offset, &line) == 2) {
+      rc = symbols_add(&symbols->lines, &symbols->lines_len, &lines_cap,
+                       offset, NULL, line);
+    }
+  }
+
+  fclose(in);
+  if (rc == ERROR) {
+    fprintf(stderr, "error: cannot allocate symbols\n");
+    return ERROR;
+  }
+  qsort(symbols->labels, symbols->labels_len, sizeof(struct symbol),
+        symbol_compare);
+  qsort(symbols->lines, symbols->lines_len, sizeof(struct symbol),
+        symbol_compare);
+  return SUCCESS;
+}
+
+// Last of the symbols at or before the offset
+static const struct symbol *symbol_before(const struct symbol *all, size_t len,
+                                          size_t offset) {
+  size_t low = 0;
+  size_t high = len;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (all[middle].offset <= offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low > 0 ? &all[low - 1] : NULL;
+}
+
+const struct symbol *symbol_label(const struct symbols *symbols,
+                                  size_t offset) {
+  return symbol_before(symbols->labels, symbols->labels_len, offset);
+}
+
+size_t symbol_line(const struct symbols *symbols, size_t offset) {
+  const struct symbol *symbol =
+      symbol_before(symbols->lines, symbols->lines_len, offset);
+  return symbol != NULL && symbol->offset == offset ? symbol->line : 0;
+}
+
+void symbols_free(struct symbols *symbols) {
+  for (size_t i = 0; i < symbols->labels_len; i++) {
+    free(symbols->labels[i].name);
+  }
+  free(symbols->labels);
+  free(symbols->lines);
+  memset(symbols, 0, sizeof(struct symbols));
+}
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int insn_has_feed(uint8_t opcode) {
+  return opcode == PUSH || opcode == CALL || opcode == SETHDLR ||
+         opcode == LOAD || opcode == STORE || opcode == FFI_CALL ||
+         opcode == NATIVE || opcode == RESV || opcode == ARENA ||
+         opcode == SPAWN || (opcode >= JNZ && opcode <= JMP);
+}
+
+static int insn_is_native(uint8_t opcode) {
+  switch ((enum opcode)opcode) {
+  case NOP:
+  case PUSH:
+  case POP:
+  case SWAP:
+  case ROT3:
+  case ADD:
+  case SUB:
+  case DIV:
+  case MUL:
+  case MOD:
+  case AND:
+  case OR:
+  case XOR:
+  case NEQ:
+  case EQ:
+  case LT:
+  case LE:
+  case GT:
+  case GE:
+  case NOT:
+  case JNZ:
+  case JZ:
+  case JMP:
+  case CALL:
+  case RET:
+  case LOAD:
+  case STORE:
+  case PEEK:
+  case POKE:
+  case SETHDLR:
+  case FFI_CALL:
+  case NATIVE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Operation of a plain instruction, specialized for its mode when there is
+// one for it
+uint16_t insn_base_op(uint8_t opcode, uint8_t mode) {
+  if (!insn_is_native(opcode)) {
+    return OP_STEP;
+  }
+
+#define TYPED_CASE(op, sym, mode, member)                                      \
+  case op << 8 | mode:                                                         \
+    return OP_##op##_##member;
+  if ((opcode == PEEK || opcode == POKE) && (mode & 0x0F) != 0x00) {
+    return OP_STEP;
+  }
+  if (opcode == LOAD || opcode == STORE || opcode == PEEK || opcode == POKE) {
+    switch (opcode << 8 | (mode & 0xF0)) {
+      CVM_MEMORY_OPS(TYPED_CASE)
+    default:
+      return (mode & 0xF0) == 0x00 ? opcode : OP_STEP;
+    }
+  }
+
+  switch (opcode << 8 | mode) {
+    CVM_TYPED_OPS(TYPED_CASE)
+    CVM_TYPED_UNARY_OPS(TYPED_CASE)
+  default:
+    return opcode;
+  }
+#undef TYPED_CASE
+}
+
+// Bytes moved by a memory opcode with the mode, or 0 for an unknown type
+size_t insn_width(uint8_t mode) {
+  static const size_t widths[] = {1, 2, 4, 8, 1, 2, 4, 8, 4, 8};
+  size_t type = mode >> 4;
+  return type < sizeof(widths) / sizeof(widths[0]) ? widths[type] : 0;
+}
+
+struct insn *insn_at(struct vm *vm, size_t offset) {
+  if (offset % 4 != 0 || offset / 4 > vm->insns_count) {
+    return NULL;
+  }
+
+  return &vm->insns[offset / 4];
+}
+
+// Offset of the next instruction, including the feeds the threaded
+// interpreter leaves to the step one, or 0 when the feed is not valid
+size_t insn_next(struct vm *vm, struct insn *insn) {
+  if (insn->op != OP_STEP) {
+    return insn->next;
+  }
+
+  size_t offset = insn->offset;
+  if (insn->opcode == PUSH && insn->mode == 0x04) {
+    size_t len = insn->arg1;
+    if (len == 0 || len % 4 != 0 || offset + 4 + len > vm->code_size ||
+        vm->code[offset + 4 + len - 1] != '\0') {
+      return 0;
+    }
+    return offset + 4 + len;
+  }
+
+  if (insn_has_feed(insn->opcode)) {
+    size_t feed[] = {0, 0, 4, 8};
+    if (insn->mode > 0x03 || offset + 4 + feed[insn->mode] > vm->code_size) {
+      return 0;
+    }
+    return offset + 4 + feed[insn->mode];
+  }
+
+  return offset + 4;
+}
+
+static void insn_decode(struct vm *vm, size_t slot) {
+  struct insn *insn = &vm->insns[slot];
+  size_t offset = slot * 4;
+  insn->op = OP_STEP;
+  insn->opcode = 0;
+  insn->mode = 0;
+  insn->arg1 = 0;
+  insn->imm.u64 = 0LL;
+  insn->target = NULL;
+  insn->offset = offset;
+  insn->next = offset + 4;
+  insn->reach = 0;
+  insn->hits = 0;
+
+  // the slot after the last complete word only makes the step interpreter
+  // report that there are no more instructions
+  if (slot < vm->insns_count) {
+    uint8_t *curpos = vm->code + offset;
+    uint32_t step = decode_step(curpos);
+    insn->opcode = decode_opcode(step);
+    insn->mode = decode_arg0(step);
+    insn->arg1 = decode_arg1(step);
+    insn->op = insn_base_op(insn->opcode, insn->mode);
+  }
+
+  // memory opcodes keep their type on the high nibble
+  uint8_t feed = insn->mode;
+  if (insn->opcode == LOAD || insn->opcode == STORE) {
+    feed &= 0x0F;
+  }
+
+  // fibers are spawned by the step interpreter, but their entry is resolved
+  // for the units compiling code
+  if ((insn->op != OP_STEP || insn->opcode == SPAWN) &&
+      insn_has_feed(insn->opcode)) {
+    if (feed == 0x00 || feed == 0x01) {
+      insn->imm.u64 = insn->arg1;
+    } else if (feed == 0x02 && offset + 8 <= vm->code_size) {
+      uint8_t *curpos = vm->code + offset + 4;
+      insn->imm.u64 = decode_u32(curpos);
+      insn->next += 4;
+    } else if (feed == 0x03 && offset + 12 <= vm->code_size) {
+      uint8_t *curpos = vm->code + offset + 4;
+      insn->imm.u64 = decode_u64(curpos);
+      insn->next += 8;
+    } else {
+      // string pushes and bad feeds are reported by the step interpreter
+      insn->op = OP_STEP;
+    }
+  }
+
+  if (insn->op == JNZ || insn->op == JZ || insn->op == JMP ||
+      insn->op == CALL || insn->opcode == SPAWN) {
+    if (insn->imm.size <= (vm->code_size - 4)) {
+      insn->target = insn_at(vm, insn->imm.size);
+    }
+  }
+
+  insn->handler = NULL;
+  if (vm->insns_labels != NULL) {
+    insn->handler = vm->insns_labels[insn->op];
+  }
+}
+
+void vm_predecode_range(struct vm *vm, size_t from, size_t to) {
+  assert(vm != NULL);
+  assert(vm->insns != NULL);
+  if (to <= from) {
+    return;
+  }
+
+  // without records of its own, a vm decodes everything again
+  if (vm_own_insns(vm) == ERROR) {
+    vm_predecode(vm);
+    return;
+  }
+
+  // an instruction with a 64-bit feed spans three words, so any of the two
+  // words before the modified range may read from it; records that decode
+  // the same are kept as they were, fused and counted
+  size_t first = from / 4 >= 2 ? from / 4 - 2 : 0;
+  size_t last = (to - 1) / 4;
+  size_t changed = SIZE_MAX;
+  for (size_t slot = first; slot <= last && slot <= vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    struct insn saved = *insn;
+    insn_decode(vm, slot);
+    if (insn->opcode == saved.opcode && insn->mode == saved.mode &&
+        insn->arg1 == saved.arg1 && insn->imm.u64 == saved.imm.u64 &&
+        insn->next == saved.next && insn->target == saved.target) {
+      *insn = saved;
+    } else if (changed == SIZE_MAX) {
+      changed = slot;
+    }
+  }
+
+  // sequences starting before the changed words may include them
+  if (changed != SIZE_MAX) {
+    vm_refuse_range(vm, changed * 4, (last + 1) * 4);
+  }
+}
+
+// Copies the records shared with the program before they change, from then
+// on they are only this vm's
+retcode vm_own_insns(struct vm *vm) {
+  assert(vm != NULL);
+  if (!vm->insns_shared) {
+    return SUCCESS;
+  }
+
+  size_t size = sizeof(struct insn) * (vm->insns_count + 1);
+  struct insn *insns = malloc(size);
+  if (insns == NULL) {
+    return ERROR;
+  }
+
+  // resolved jumps still point into the shared records
+  struct insn *shared = vm->insns;
+  memcpy(insns, shared, size);
+  for (size_t slot = 0; slot <= vm->insns_count; slot++) {
+    if (insns[slot].target != NULL) {
+      insns[slot].target = insns + (insns[slot].target - shared);
+    }
+  }
+  vm->insns = insns;
+  vm->insns_shared = 0;
+  return SUCCESS;
+}
+
+retcode vm_predecode(struct vm *vm) {
+  assert(vm != NULL);
+  size_t count = vm->code_size / 4;
+
+  // one extra slot to catch execution falling off the end of code, cleared
+  // so that no record decodes the same as before
+  struct insn *insns = calloc(count + 1, sizeof(struct insn));
+  if (insns == NULL) {
+    fprintf(stderr, "error: cannot allocate pre-decoded code\n");
+    return ERROR;
+  }
+
+  if (vm->insns != NULL && !vm->insns_shared) {
+    free(vm->insns);
+  }
+
+  vm->insns = insns;
+  vm->insns_shared = 0;
+  vm->insns_count = count;
+  vm->verified = 0;
+  // fused on the way, like any decoded range
+  vm_predecode_range(vm, 0, (count + 1) * 4);
+  return SUCCESS;
+}
+
+
+// The dispatch loop is instantiated twice: the checked one can run any code
+// and the unchecked one only code that passed vm_verify
+#define CVM_CHECKED 1
+#define THREADED_FN vm_run_threaded
+#include "cvm_dispatch.inc"
+#undef THREADED_FN
+#undef CVM_CHECKED
+
+#define CVM_CHECKED 0
+#define THREADED_FN vm_run_verified
+#include "cvm_dispatch.inc"
+#undef THREADED_FN
+#undef CVM_CHECKED
+
+// The tiered mode interprets with a checked loop that also counts hits
+#define CVM_CHECKED 1
+#define CVM_TIERED 1
+#define THREADED_FN vm_run_counting
+#include "cvm_dispatch.inc"
+#undef THREADED_FN
+#undef CVM_TIERED
+#undef CVM_CHECKED
+
+// The profiled mode counts on the checked loop, see cvm_profile.c
+#define CVM_CHECKED 1
+#define CVM_PROFILE 1
+#define THREADED_FN vm_run_profiled
+#include "cvm_dispatch.inc"
+#undef THREADED_FN
+#undef CVM_PROFILE
+#undef CVM_CHECKED
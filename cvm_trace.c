@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Execution trace: while a vm is traced, the interpreters take a record of
+ * each instruction they run (trace_insn) on a ring of the last ones, with
+ * its offset, opcode, mode, the depth of the call stack and the top of the
+ * data stack, and drop the oldest one to make room. The ring is dumped to a
+ * file when the vm halts or fails, on SIGUSR1 while it runs, and on SIGINT
+ * or SIGTERM before the process ends, which only takes system calls that are
+ * safe on a signal handler. cvmtrace prints the dumps. JIT and AOT code is
+ * not traced, so the ring only has what was interpreted. */
+
+static struct vm *traced; // dumped on signals
+
+static void trace_signal(int signal) {
+  int saved = errno;
+  if (traced != NULL) {
+    trace_dump(traced, TRACE_SIGNAL);
+  }
+  errno = saved;
+
+  // dumped on SIGUSR1 and then the vm goes on, the rest end it
+  if (signal != SIGUSR1) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, NULL);
+    raise(signal);
+  }
+}
+
+retcode trace_init(struct vm *vm, const char *filename, size_t records) {
+  assert(vm != NULL);
+  assert(filename != NULL);
+  assert(vm->trace == NULL);
+  size_t len = 1;
+  while (len < records) {
+    len *= 2;
+  }
+
+  struct trace *trace = calloc(1, sizeof(struct trace));
+  if (trace != NULL) {
+    trace->records = calloc(len, sizeof(struct trace_record));
+  }
+  if (trace == NULL || trace->records == NULL) {
+    fprintf(stderr, "error: cannot allocate trace\n");
+    free(trace);
+    return ERROR;
+  }
+  trace->mask = len - 1;
+  trace->filename = filename;
+  vm->trace = trace;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = trace_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  traced = vm;
+  if (sigaction(SIGUSR1, &action, NULL) != 0 ||
+      sigaction(SIGINT, &action, NULL) != 0 ||
+      sigaction(SIGTERM, &action, NULL) != 0) {
+    perror("trace signal");
+    trace_free(vm);
+    return ERROR;
+  }
+  return SUCCESS;
+}
+
+static int trace_write(int fd, const void *buffer, size_t size) {
+  const uint8_t *bytes = buffer;
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return -1;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return 0;
+}
+
+// Safe on a signal handler, so it reports nothing and takes no locks
+retcode trace_dump(struct vm *vm, enum trace_reason reason) {
+  assert(vm != NULL);
+  struct trace *trace = vm->trace;
+  if (trace == NULL) {
+    return SUCCESS;
+  }
+
+  uint64_t total = __atomic_load_n(&trace->total, __ATOMIC_ACQUIRE);
+  uint64_t len = trace->mask + 1;
+  uint64_t count = total < len ? total : len;
+  struct trace_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.reason = reason;
+  header.total = total;
+  header.count = count;
+  header.error_code = vm->error_code;
+  header.record_size = sizeof(struct trace_record);
+
+  int fd = open(trace->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    return ERROR;
+  }
+
+  // from the oldest record, which is where the next one goes once it wraps
+  uint64_t first = (total - count) & trace->mask;
+  uint64_t before_end = len - first < count ? len - first : count;
+  int failed =
+      trace_write(fd, &header, sizeof(header)) != 0 ||
+      trace_write(fd, &trace->records[first],
+                  sizeof(struct trace_record) * before_end) != 0 ||
+      trace_write(fd, trace->records,
+                  sizeof(struct trace_record) * (count - before_end)) != 0;
+  if (close(fd) != 0) {
+    failed = 1;
+  }
+  return failed ? ERROR : SUCCESS;
+}
+
+void trace_free(struct vm *vm) {
+  assert(vm != NULL);
+  struct trace *trace = vm->trace;
+  if (trace == NULL) {
+    return;
+  }
+
+  if (traced == vm) {
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    traced = NULL;
+  }
+  free(trace->records);
+  free(trace);
+  vm->trace = NULL;
+}
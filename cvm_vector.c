@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Vector opcodes over arrays of the data segment. The kernels of every type
+ * come from cvm_vector.inc and are built once for each unit below, then
+ * vector_init asks cpuid for the widest unit the cpu has. The scalar unit is
+ * the same code with vectorization turned off, to check the others. */
+
+#define VECTOR_BYTES 64 // bytes in a block, an AVX-512 register
+#define VECTOR_CONCAT(a, b) VECTOR_CONCAT_(a, b)
+#define VECTOR_CONCAT_(a, b) a##b
+
+#define VECTOR_ADD(acc, value) ((acc) + (value))
+#define VECTOR_MIN(acc, value) ((value) < (acc) ? (value) : (acc))
+#define VECTOR_MAX(acc, value) ((value) > (acc) ? (value) : (acc))
+
+/* Element types by mode, the same ones value_op takes */
+#define VECTOR_TYPES(X)                                                        \
+  X(0x00, u8, uint8_t)                                                         \
+  X(0x01, u16, uint16_t)                                                       \
+  X(0x02, u32, uint32_t)                                                       \
+  X(0x03, u64, uint64_t)                                                       \
+  X(0x04, i8, int8_t)                                                          \
+  X(0x05, i16, int16_t)                                                        \
+  X(0x06, i32, int32_t)                                                        \
+  X(0x07, i64, int64_t)                                                        \
+  X(0x08, f32, float)                                                          \
+  X(0x09, f64, double)
+
+#define VECTOR_TYPE uint8_t
+#define VECTOR_MEMBER u8
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE uint16_t
+#define VECTOR_MEMBER u16
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE uint32_t
+#define VECTOR_MEMBER u32
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE uint64_t
+#define VECTOR_MEMBER u64
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE int8_t
+#define VECTOR_MEMBER i8
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE int16_t
+#define VECTOR_MEMBER i16
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE int32_t
+#define VECTOR_MEMBER i32
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE int64_t
+#define VECTOR_MEMBER i64
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE float
+#define VECTOR_MEMBER f32
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_TYPE double
+#define VECTOR_MEMBER f64
+#include "cvm_vector.inc"
+#undef VECTOR_MEMBER
+#undef VECTOR_TYPE
+
+#define VECTOR_CASE(mode, member, type)                                        \
+  case mode:                                                                   \
+    vector_run_##member(args, (vector_elem_##member *)args->to,                \
+                        (const vector_elem_##member *)args->from);             \
+    break;
+
+// Every unit inlines all the kernels, built with its own instructions
+#define VECTOR_UNIT(name, attributes)                                          \
+  static attributes void vector_##name(struct vector_args *args) {             \
+    switch (args->mode) {                                                      \
+      VECTOR_TYPES(VECTOR_CASE)                                                \
+    default:                                                                   \
+      assert(0 && "unreachable code");                                         \
+      break;                                                                   \
+    }                                                                          \
+  }
+
+VECTOR_UNIT(scalar, __attribute__((optimize("no-tree-vectorize",
+                                            "no-tree-slp-vectorize"))))
+VECTOR_UNIT(generic, )
+#if defined(__x86_64__)
+VECTOR_UNIT(avx2, __attribute__((target("avx2,fma"))))
+VECTOR_UNIT(avx512, __attribute__((target("avx512f,avx512bw,avx512dq,fma"))))
+#endif
+
+struct vector_unit {
+  const char *name;
+  void (*run)(struct vector_args *args);
+};
+
+// Widest first, generic is the baseline of the target (SSE2 on x86-64)
+static const struct vector_unit vector_units[] = {
+#if defined(__x86_64__)
+    {"avx512", vector_avx512},
+    {"avx2", vector_avx2},
+    {"sse2", vector_generic},
+#else
+    {"generic", vector_generic},
+#endif
+    {"scalar", vector_scalar},
+};
+
+static const size_t vector_units_len =
+    sizeof(vector_units) / sizeof(vector_units[0]);
+
+static const struct vector_unit *vector_unit = NULL;
+
+static int vector_supported(const struct vector_unit *unit) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (unit->run == vector_avx512) {
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512dq");
+  }
+  if (unit->run == vector_avx2) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  }
+#endif
+  return 1;
+}
+
+void vector_init(void) {
+  if (vector_unit != NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < vector_units_len; i++) {
+    if (vector_supported(&vector_units[i])) {
+      vector_unit = &vector_units[i];
+      return;
+    }
+  }
+}
+
+retcode vector_select(const char *name) {
+  assert(name != NULL);
+  for (size_t i = 0; i < vector_units_len; i++) {
+    if (strcmp(vector_units[i].name, name) != 0) {
+      continue;
+    }
+
+    if (!vector_supported(&vector_units[i])) {
+      fprintf(stderr, "error: this cpu has no %s unit\n", name);
+      return ERROR;
+    }
+    vector_unit = &vector_units[i];
+    return SUCCESS;
+  }
+
+  fprintf(stderr, "error: unknown vector unit %s\n", name);
+  return ERROR;
+}
+
+size_t vector_width(uint8_t mode) {
+#define VECTOR_WIDTH(mode, member, type)                                       \
+  case mode:                                                                   \
+    return sizeof(type);
+  switch (mode) {
+    VECTOR_TYPES(VECTOR_WIDTH)
+  default:
+    return 0;
+  }
+#undef VECTOR_WIDTH
+}
+
+retcode vector_run(struct vector_args *args) {
+  assert(args != NULL);
+  vector_init();
+
+  // the kernels take both arrays as restrict, so an array that overlaps the
+  // one written is read from a copy, as if it was read before writing
+  size_t size = args->len * vector_width(args->mode);
+  uint8_t *copy = NULL;
+  if (args->opcode != VSUM && args->opcode != VMIN && args->opcode != VMAX &&
+      args->opcode != VDOT && args->to < args->from + size &&
+      args->from < args->to + size) {
+    copy = malloc(size);
+    if (copy == NULL) {
+      return ERROR;
+    }
+    memcpy(copy, args->from, size);
+    args->from = copy;
+  }
+
+  vector_unit->run(args);
+  free(copy);
+  return SUCCESS;
+}
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Load-time verifier for pre-decoded code. Every function (the entry point
+ * and every CALL target) is interpreted abstractly with the data stack depth
+ * relative to its entry, which must be the same on every path reaching an
+ * instruction. Calls are summarized by the values the callee needs below its
+ * entry, the most it grows above it and its effect when it returns, and the
+ * whole program is walked again until those summaries stop changing. */
+
+#define MAX_VERIFY_PASSES 64
+
+enum slot_kind { SLOT_UNKNOWN, SLOT_INSN, SLOT_FEED };
+
+struct verify_fn {
+  size_t entry;  // slot of the first instruction
+  int64_t need;  // values required below the entry
+  int64_t reach; // values above the entry, callees not included
+  int64_t net;   // data stack effect when it returns
+  int returns;
+};
+
+struct verifier {
+  struct vm *vm;
+  uint8_t *kind;
+  int *owner;     // function that reached each slot, -1 when not reached
+  int64_t *depth; // data stack depth relative to the owner's entry
+  size_t *work;
+  size_t work_len;
+  struct verify_fn *fns;
+  size_t fns_len;
+  size_t fns_cap;
+  int changed;
+};
+
+static retcode verify_fail(struct verifier *v, size_t slot, const char *format,
+                           ...) {
+  va_list args;
+  fprintf(stderr, "verify: ");
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, " (at offset %lu)\n", slot * 4);
+  (void)v;
+  return ERROR;
+}
+
+static int verify_fn_at(struct verifier *v, size_t slot) {
+  for (size_t i = 0; i < v->fns_len; i++) {
+    if (v->fns[i].entry == slot) {
+      return i;
+    }
+  }
+
+  if (v->fns_len == v->fns_cap) {
+    v->fns_cap = v->fns_cap == 0 ? 8 : v->fns_cap * 2;
+    v->fns = realloc(v->fns, sizeof(struct verify_fn) * v->fns_cap);
+    assert(v->fns != NULL);
+  }
+
+  struct verify_fn *fn = &v->fns[v->fns_len];
+  fn->entry = slot;
+  fn->need = 0;
+  fn->reach = 0;
+  fn->net = 0;
+  fn->returns = 0;
+  v->changed = 1;
+  return v->fns_len++;
+}
+
+static retcode verify_visit(struct verifier *v, int fn, size_t slot,
+                            int64_t depth) {
+  if (v->owner[slot] == fn) {
+    if (v->depth[slot] != depth) {
+      return verify_fail(v, slot,
+                         "inconsistent data stack depth (%" PRId64
+                         " and %" PRId64 ")",
+                         v->depth[slot], depth);
+    }
+    return SUCCESS;
+  }
+
+  if (v->owner[slot] != -1) {
+    return verify_fail(v, slot, "code shared by functions at %lu and %lu",
+                       v->fns[v->owner[slot]].entry * 4, v->fns[fn].entry * 4);
+  }
+
+  v->owner[slot] = fn;
+  v->depth[slot] = depth;
+  v->work[v->work_len++] = slot;
+  return SUCCESS;
+}
+
+// Data stack values popped and pushed, or -1 for opcodes that cannot be
+// verified
+static int verify_effect(struct insn *insn, int *pops, int *pushes) {
+  *pops = 0;
+  *pushes = 0;
+  switch ((enum opcode)insn->opcode) {
+  case NOP:
+  case HALT:
+  case CLRS:
+  case PSTATE:
+  case JMP:
+  case CALL:
+  case RET:
+  case SETHDLR:
+  case CLRERR:
+  case FFI_MAKE_DONE:
+  case RESET:
+    break;
+  case PUSH:
+  case LOAD:
+  case RESV:
+  case ARENA:
+    *pushes = 1;
+    break;
+  case POP:
+  case STORE:
+  case FREE:
+  case FFI_LIB_LOAD:
+  case FFI_LIB_SELECT:
+    *pops = 1;
+    break;
+  case PEEK:
+    *pops = *pushes = 1;
+    break;
+  case SWAP:
+    *pops = *pushes = 2;
+    break;
+  case ROT3:
+    *pops = *pushes = 3;
+    break;
+  case ADD:
+  case SUB:
+  case DIV:
+  case MUL:
+  case NEQ:
+  case EQ:
+  case LT:
+  case LE:
+  case GT:
+  case GE:
+    if (insn->mode > 0x09) {
+      return -1;
+    }
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case MOD:
+  case AND:
+  case OR:
+  case XOR:
+    if (insn->mode > 0x07) {
+      return -1;
+    }
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case NOT:
+    if (insn->mode > 0x07) {
+      return -1;
+    }
+    *pops = *pushes = 1;
+    break;
+  case JNZ:
+  case JZ:
+    *pops = *pushes = 1;
+    break;
+  case PSEG:
+  case POKE:
+  case SETERR:
+    *pops = 2;
+    break;
+  case MEMCPY:
+  case MEMSET:
+    *pops = 3;
+    break;
+  case MEMCMP:
+  case VDOT:
+    *pops = 3;
+    *pushes = 1;
+    break;
+  case VADD:
+  case VMUL:
+  case VCMP:
+    *pops = 3;
+    break;
+  case VFMA:
+    *pops = 4;
+    break;
+  case VSUM:
+  case VMIN:
+  case VMAX:
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case CLOSE:
+    *pops = *pushes = 1;
+    break;
+  case OPEN:
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case READ:
+  case WRITE:
+    *pops = 3;
+    *pushes = 1;
+    break;
+  case SPAWN:
+  case YIELD:
+  case JOIN:
+    // fibers switch to stacks without guard pages
+    return -1;
+  default:
+    // FFI_MAKE_EXTERN stores entry points anywhere on code, and what an
+    // FFI_CALL or a NATIVE pops and pushes is up to the C function
+    return -1;
+  }
+
+  return 0;
+}
+
+static retcode verify_function(struct verifier *v, int fn) {
+  struct vm *vm = v->vm;
+  v->work_len = 0;
+  if (verify_visit(v, fn, v->fns[fn].entry, 0) == ERROR) {
+    return ERROR;
+  }
+
+  while (v->work_len > 0) {
+    size_t slot = v->work[--v->work_len];
+    int64_t depth = v->depth[slot];
+    struct insn *insn = &vm->insns[slot];
+    int pops = 0;
+    int pushes = 0;
+
+    if (slot == vm->insns_count) {
+      return verify_fail(v, slot, "execution falls off the end of code");
+    }
+
+    if (v->kind[slot] == SLOT_FEED) {
+      return verify_fail(v, slot, "jump into the middle of an instruction");
+    }
+    v->kind[slot] = SLOT_INSN;
+
+    size_t next = insn_next(vm, insn);
+    if (next == 0) {
+      return verify_fail(v, slot, "invalid feed mode %02hhX for opcode %02hhX",
+                         insn->mode, insn->opcode);
+    }
+
+    for (size_t feed = slot + 1; feed < next / 4; feed++) {
+      if (v->kind[feed] == SLOT_INSN) {
+        return verify_fail(v, feed, "instruction overlaps a feed");
+      }
+      v->kind[feed] = SLOT_FEED;
+    }
+
+    if (verify_effect(insn, &pops, &pushes) == -1) {
+      return verify_fail(v, slot, "cannot verify opcode %02hhX with mode %02hhX",
+                         insn->opcode, insn->mode);
+    }
+
+    struct verify_fn *f = &v->fns[fn];
+    if (pops - depth > f->need) {
+      f->need = pops - depth;
+    }
+
+    depth = depth - pops + pushes;
+    if (depth > f->reach) {
+      f->reach = depth;
+    }
+
+    if (f->need > vm->data.cap || f->reach > vm->data.cap) {
+      return verify_fail(v, slot, "data stack cannot hold the function");
+    }
+
+    switch ((enum opcode)insn->opcode) {
+    case HALT:
+    case SETERR:
+      break;
+    case CLRS:
+      // only the entry point knows the absolute depth
+      if (fn != 0) {
+        return verify_fail(v, slot, "clsstack inside a function");
+      }
+      if (verify_visit(v, fn, next / 4, -(vm->data.top + 1)) == ERROR) {
+        return ERROR;
+      }
+      break;
+    case RET:
+      if (f->returns && f->net != depth) {
+        return verify_fail(v, slot,
+                           "inconsistent data stack effect on return (%" PRId64
+                           " and %" PRId64 ")",
+                           f->net, depth);
+      }
+      v->changed |= !f->returns;
+      f->net = depth;
+      f->returns = 1;
+      break;
+    case JNZ:
+    case JZ:
+    case JMP:
+      if (insn->target == NULL || insn->target->offset + 4 > vm->code_size) {
+        return verify_fail(v, slot, "invalid jump target %lu", insn->imm.size);
+      }
+      if (verify_visit(v, fn, insn->target->offset / 4, depth) == ERROR) {
+        return ERROR;
+      }
+      if (insn->opcode != JMP &&
+          verify_visit(v, fn, next / 4, depth) == ERROR) {
+        return ERROR;
+      }
+      break;
+    case CALL: {
+      if (insn->target == NULL || insn->target->offset + 4 > vm->code_size) {
+        return verify_fail(v, slot, "invalid call target %lu", insn->imm.size);
+      }
+
+      int callee = verify_fn_at(v, insn->target->offset / 4);
+      struct verify_fn *g = &v->fns[callee];
+      f = &v->fns[fn];
+      if (g->need - depth > f->need) {
+        f->need = g->need - depth;
+      }
+
+      // the rest of the caller is reached once the callee is known to return
+      if (g->returns) {
+        if (depth + g->net > f->reach) {
+          f->reach = depth + g->net;
+        }
+        if (verify_visit(v, fn, next / 4, depth + g->net) == ERROR) {
+          return ERROR;
+        }
+      }
+    } break;
+    default:
+      if (verify_visit(v, fn, next / 4, depth) == ERROR) {
+        return ERROR;
+      }
+      break;
+    }
+  }
+
+  return SUCCESS;
+}
+
+static retcode verify_pass(struct verifier *v) {
+  size_t slots = v->vm->insns_count + 1;
+  memset(v->kind, SLOT_UNKNOWN, sizeof(uint8_t) * slots);
+  for (size_t i = 0; i < slots; i++) {
+    v->owner[i] = -1;
+  }
+
+  // callees found during the pass are appended and walked on the same pass
+  for (size_t fn = 0; fn < v->fns_len; fn++) {
+    if (verify_function(v, fn) == ERROR) {
+      return ERROR;
+    }
+  }
+
+  return SUCCESS;
+}
+
+static retcode verify_memory(struct verifier *v) {
+  struct vm *vm = v->vm;
+  for (size_t slot = 0; slot < vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    if (v->kind[slot] != SLOT_INSN || insn->op == OP_STEP) {
+      continue;
+    }
+
+    // superinstruction heads keep the opcode they were decoded with
+    size_t address = insn->imm.size;
+    size_t width = insn_width(insn->mode);
+    int outside = address > vm->code_size || vm->code_size - address < width;
+    if (insn->opcode == LOAD && outside) {
+      return verify_fail(v, slot, "load outside code segment");
+    } else if (insn->opcode == STORE) {
+      if (outside) {
+        return verify_fail(v, slot, "store outside code segment");
+      }
+      for (size_t word = address / 4; word <= (address + width - 1) / 4;
+           word++) {
+        if (v->kind[word] != SLOT_UNKNOWN) {
+          return verify_fail(v, slot, "store into reachable code");
+        }
+      }
+    } else if (insn->opcode == SETHDLR) {
+      struct insn *handler = insn_at(vm, insn->imm.size);
+      if (handler == NULL || insn->imm.size + 4 > vm->code_size ||
+          v->kind[handler->offset / 4] == SLOT_FEED) {
+        return verify_fail(v, slot, "invalid error handler %lu",
+                           insn->imm.size);
+      }
+    }
+  }
+
+  return SUCCESS;
+}
+
+retcode vm_verify(struct vm *vm) {
+  assert(vm != NULL);
+  if ((vm->insns == NULL && vm_predecode(vm) == ERROR) ||
+      vm_own_insns(vm) == ERROR) {
+    return ERROR;
+  }
+
+  size_t slots = vm->insns_count + 1;
+  struct verifier v = {.vm = vm};
+  v.kind = malloc(sizeof(uint8_t) * slots);
+  v.owner = malloc(sizeof(int) * slots);
+  v.depth = malloc(sizeof(int64_t) * slots);
+  v.work = malloc(sizeof(size_t) * slots);
+  assert(v.kind != NULL && v.owner != NULL && v.depth != NULL &&
+         v.work != NULL);
+
+  retcode rc = ERROR;
+  struct insn *entry = insn_at(vm, vm->code_offset);
+  if (entry == NULL) {
+    verify_fail(&v, vm->code_offset / 4, "unaligned entry point");
+    goto done;
+  }
+  verify_fn_at(&v, entry->offset / 4);
+
+  int pass = 0;
+  for (; pass < MAX_VERIFY_PASSES && v.changed; pass++) {
+    v.changed = 0;
+    if (verify_pass(&v) == ERROR) {
+      goto done;
+    }
+  }
+
+  if (v.changed) {
+    verify_fail(&v, entry->offset / 4, "no fixed point after %d passes", pass);
+    goto done;
+  }
+
+  if (v.fns[0].need > vm->data.top + 1 ||
+      v.fns[0].reach + vm->data.top + 1 > vm->data.cap) {
+    verify_fail(&v, entry->offset / 4,
+                "entry point needs %" PRId64 " values and grows %" PRId64,
+                v.fns[0].need, v.fns[0].reach);
+    goto done;
+  }
+
+  if (verify_memory(&v) == ERROR) {
+    goto done;
+  }
+
+  for (size_t slot = 0; slot < vm->insns_count; slot++) {
+    struct insn *insn = &vm->insns[slot];
+    if (v.kind[slot] == SLOT_INSN && insn->op == CALL) {
+      insn->reach = v.fns[verify_fn_at(&v, insn->target->offset / 4)].reach;
+    }
+  }
+
+  vm->verified = 1;
+  rc = SUCCESS;
+
+done:
+  free(v.kind);
+  free(v.owner);
+  free(v.depth);
+  free(v.work);
+  free(v.fns);
+  return rc;
+}
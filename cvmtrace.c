@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include "cvm.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Prints the execution trace cvm --trace dumps, an instruction a line from
+ * the oldest one, named by the labels and source lines of the symbol file of
+ * chasm when it is given one. Dumps are read on the host that wrote them. */
+
+static const char *opcode_names[256] = {
+    [NOP] = "NOP",
+    [HALT] = "HALT",
+    [CLRS] = "CLRSTACK",
+    [PSTATE] = "PSTATE",
+    [PUSH] = "PUSH",
+    [POP] = "POP",
+    [SWAP] = "SWAP",
+    [ROT3] = "ROT3",
+    [ADD] = "ADD",
+    [SUB] = "SUB",
+    [DIV] = "DIV",
+    [MUL] = "MUL",
+    [MOD] = "MOD",
+    [AND] = "AND",
+    [OR] = "OR",
+    [XOR] = "XOR",
+    [NEQ] = "NEQ",
+    [EQ] = "EQ",
+    [LT] = "LT",
+    [LE] = "LE",
+    [GT] = "GT",
+    [GE] = "GE",
+    [NOT] = "NOT",
+    [JNZ] = "JNZ",
+    [JZ] = "JZ",
+    [JMP] = "JMP",
+    [CALL] = "CALL",
+    [RET] = "RET",
+    [RESV] = "RESV",
+    [FREE] = "FREE",
+    [ARENA] = "ARENA",
+    [LOAD] = "LOAD",
+    [STORE] = "STORE",
+    [PSEG] = "PSEG",
+    [RESET] = "RESET",
+    [PEEK] = "PEEK",
+    [POKE] = "POKE",
+    [MEMCPY] = "MEMCPY",
+    [MEMSET] = "MEMSET",
+    [MEMCMP] = "MEMCMP",
+    [SETHDLR] = "SETHDLR",
+    [SETERR] = "SETERR",
+    [CLRERR] = "CLRERR",
+    [FFI_LIB_LOAD] = "FFI_LIB_LOAD",
+    [FFI_LIB_SELECT] = "FFI_LIB_SELECT",
+    [FFI_MAKE_EXTERN] = "FFI_MAKE_EXTERN",
+    [FFI_MAKE_DONE] = "FFI_MAKE_DONE",
+    [FFI_CALL] = "FFI_CALL",
+    [NATIVE] = "NATIVE",
+    [VADD] = "VADD",
+    [VMUL] = "VMUL",
+    [VFMA] = "VFMA",
+    [VCMP] = "VCMP",
+    [VSUM] = "VSUM",
+    [VMIN] = "VMIN",
+    [VMAX] = "VMAX",
+    [VDOT] = "VDOT",
+    [SPAWN] = "SPAWN",
+    [YIELD] = "YIELD",
+    [JOIN] = "JOIN",
+    [OPEN] = "OPEN",
+    [READ] = "READ",
+    [WRITE] = "WRITE",
+    [CLOSE] = "CLOSE",
+};
+
+static const char *reasons[] = {"halt", "error", "signal"};
+
+static void trace_print(const struct trace_record *record,
+                        const struct symbols *symbols) {
+  char opcode[16];
+  const char *name = opcode_names[record->opcode];
+  if (name == NULL) {
+    snprintf(opcode, sizeof(opcode), "0x%02X", record->opcode);
+    name = opcode;
+  }
+
+  printf("%08" PRIx32 "  %-16s %02X  %5u  %016" PRIx64, record->offset, name,
+         record->mode, record->depth, record->top);
+
+  const struct symbol *label = symbol_label(symbols, record->offset);
+  if (label != NULL) {
+    printf("  %s+%zu", label->name, record->offset - label->offset);
+  }
+  size_t line = symbol_line(symbols, record->offset);
+  if (line > 0) {
+    printf(" (line %zu)", line);
+  }
+  putchar('\n');
+}
+
+int main(int argc, char **argv) {
+  char *symbols_filename = NULL;
+  char *filename = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--symbols=", 10) == 0 && argv[i][10] != '\0') {
+      symbols_filename = argv[i] + 10;
+    } else if (filename == NULL && argv[i][0] != '-') {
+      filename = argv[i];
+    } else {
+      filename = NULL;
+      break;
+    }
+  }
+
+  if (filename == NULL) {
+    printf("usage: %s [--symbols=<file>] <trace dump>\n", argv[0]);
+    return 1;
+  }
+
+  struct symbols symbols;
+  memset(&symbols, 0, sizeof(symbols));
+  if (symbols_filename != NULL &&
+      symbols_load(&symbols, symbols_filename) == ERROR) {
+    return 1;
+  }
+
+  FILE *in = fopen(filename, "rb");
+  if (in == NULL) {
+    perror("open trace");
+    symbols_free(&symbols);
+    return 1;
+  }
+
+  struct trace_header header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.record_size != sizeof(struct trace_record) ||
+      header.reason > TRACE_SIGNAL) {
+    fprintf(stderr, "error: %s is not a trace dump\n", filename);
+    fclose(in);
+    symbols_free(&symbols);
+    return 1;
+  }
+
+  printf("# dumped on %s", reasons[header.reason]);
+  if (header.error_code != 0) {
+    printf(" with error 0x%x", header.error_code);
+  }
+  printf(", the last %" PRIu64 " of %" PRIu64 " instructions traced\n",
+         header.count, header.total);
+  printf("# offset  opcode           mode depth  top of the stack\n");
+
+  int rc = 0;
+  struct trace_record record;
+  for (uint64_t i = 0; i < header.count; i++) {
+    if (fread(&record, sizeof(record), 1, in) != 1) {
+      fprintf(stderr, "error: trace dump cut after %" PRIu64 " records\n", i);
+      rc = 1;
+      break;
+    }
+    trace_print(&record, &symbols);
+  }
+
+  fclose(in);
+  symbols_free(&symbols);
+  return rc;
+}